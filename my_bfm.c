@@ -4,6 +4,9 @@
 //Define Statements
 #define     _GNU_SOURCE
 #define     BUF_SIZE                1024
+#define     DIRENT_BUF_SIZE         32768   // getdents64 buffer, large enough to read most directories in one call
+#define     ARENA_BLOCK_SIZE        65536
+#define     PATH_INITIAL_SIZE       256
 #define     N_BYTES                 50
 #define     MAX_APPEND_SIZE         50
 #define     MAX_BUF_SIZE            100
@@ -13,6 +16,78 @@
 #define     IS_DIRECTORY            1
 #define     ENABLE                  1
 #define     DISABLE                 0
+#define     DEFAULT_MODE            S_IRWXU
+#define     MAX_THREADS             256
+#define     OP_CREATE               0
+#define     OP_DELETE               1
+#define     OP_RENAME               2
+#define     OP_APPEND               3
+#define     OP_SYNC                 4
+#define     OP_GC                   5
+#define     OP_PACK                 6
+#define     OP_UNPACK               7
+#define     OP_META                 8
+#define     OP_SWAP                 9
+#define     OP_TOP                  10
+#define     WALK_CONTINUE           0
+#define     WALK_DESCEND            1
+#define     SYNC_MKDIR              0
+#define     SYNC_RENAME             1
+#define     SYNC_COPY               2
+#define     SYNC_APPEND             3
+#define     SYNC_DELETE             4
+#define     SYNC_CHMOD              5
+#define     SYNC_PHASES             6
+#define     SYNC_CHECK              6       // Content comparison while planning, not a phase
+#define     COPY_CHUNK_SIZE         (1 << 30)
+#define     HASH_BUF_SIZE           65536
+#define     FNV_OFFSET_BASIS        14695981039346656037ULL
+#define     FNV_PRIME               1099511628211ULL
+#define     DURABILITY_NONE         0
+#define     DURABILITY_BATCH        1
+#define     DURABILITY_STRICT       2
+#define     BATCH_COMMIT_OPERATIONS 10000   // Commit a batch after this many changes...
+#define     BATCH_COMMIT_SECONDS    5       // ...or after this many seconds, whatever comes first
+#define     MAX_BATCH_FILESYSTEMS   64
+#define     GC_MAX_CANDIDATES       262144  // Oldest files remembered per garbage collection round
+#define     TAR_BLOCK_SIZE          512
+#define     TAR_NAME_SIZE           100
+#define     TAR_MAGIC               "ustar  "   // GNU magic and version, what tar -x expects with L/K records
+#define     TAR_REGULAR             '0'
+#define     TAR_REGULAR_OLD         '\0'
+#define     TAR_HARDLINK            '1'
+#define     TAR_SYMLINK             '2'
+#define     TAR_DIRECTORY           '5'
+#define     TAR_CONTIGUOUS          '7'
+#define     TAR_LONG_NAME           'L'
+#define     TAR_LONG_LINK           'K'
+#define     PACK_BUF_SIZE           (1 << 20)
+#define     PACK_WINDOW             32      // Files of a directory opened and read ahead at once
+#define     UNPACK_INLINE_MAX       (256 << 10) // Larger files are written by the reader itself
+#define     UNPACK_QUEUE_BYTES      (64 << 20)  // File data waiting for the unpack workers
+#define     UNPACK_SPLICE           0
+#define     UNPACK_COPY_RANGE       1
+#define     UNPACK_READ             2
+#define     REAP_NICE               19      // Background removal takes only otherwise idle CPU...
+#define     IOPRIO_WHO_PROCESS      1
+#define     IOPRIO_CLASS_IDLE       3       // ...and otherwise idle disk time
+#define     IOPRIO_CLASS_SHIFT      13
+#define     STATS_DIRECTORY         "/dev/shm"
+#define     STATS_MAGIC             "MYBFMST2"
+#define     STATS_CACHE_LINE        64
+#define     STATS_INTERVAL          1       // Seconds between lines of --top
+#define     STATS_LINE_LENGTH       256
+#define     STAT_SCANNED            0       // Entries looked at
+#define     STAT_PLANNED            1       // Entries known to need work, for the estimate
+#define     STAT_CREATED            2
+#define     STAT_UPDATED            3       // Renamed, appended to or changed metadata
+#define     STAT_DELETED            4
+#define     STAT_BYTES_WRITTEN      5
+#define     STAT_BYTES_FREED        6
+#define     STAT_ERRORS             7
+#define     STATS_COUNTERS          8
+#define     APPEND_POOL_SIZE        128     // Open O_APPEND fds kept by each fan-out worker
+#define     APPEND_WINDOW           1024    // Targets grouped per round, at most IOV_MAX records per writev
 
 // Include Statements
 #include    <sys/types.h>
@@ -25,52 +100,564 @@
 #include    <string.h>
 #include    <sys/syscall.h>
 #include    <dirent.h>
+#include    <pthread.h>
+#include    <stdarg.h>
+#include    <sys/resource.h>
+#include    <stdint.h>
+#include    <limits.h>
+#include    <sys/sysmacros.h>
+#include    <time.h>
+#include    <sys/statvfs.h>
+#include    <sys/sendfile.h>
+#include    <pwd.h>
+#include    <grp.h>
+#include    <sys/wait.h>
+#include    <sys/mman.h>
+#include    <signal.h>
+#include    <glob.h>
+#include    <sys/uio.h>
+#include    <linux/openat2.h>
 
 
 // Global Variable for Error Code
 int         ec          =           E_OK;
 
 // Global Variable Flags for deciding which operation to perform
-int         fCreate     =           DISABLE;
-int         fDelete     =           DISABLE;
-int         fRename     =           DISABLE;
-int         fAppend     =           DISABLE;
-int         fBinary     =           DISABLE;
 int         fPath       =           DISABLE;
-int         fDirectory  =           DISABLE;
 int         fLog        =           DISABLE;
+int         fChecksum   =           DISABLE;
+int         fPreallocate =          DISABLE;
+int         fKeepSize   =           DISABLE;
+int         fStats      =           DISABLE;
+int         fStatsUnlink =          DISABLE;
+
+// Options for file creation
+mode_t      createMode  =           DEFAULT_MODE;
+off_t       createSize  =           0;
+long        createCount =           1;
+int         nThreads    =           0;      // 0 means one worker per online CPU
+
+// How hard we try to get changes onto disk before reporting them as done
+int         durability  =           DURABILITY_NONE;
+
+// Targets for garbage collection, E_GENERAL when not given
+off_t       gcMaxSize   =           E_GENERAL;
+off_t       gcMinFree   =           E_GENERAL;
+long        gcTtl       =           E_GENERAL;
+int         fGcByAtime  =           ENABLE;
+
+// Targets for --meta, E_GENERAL when not given
+long        metaMode    =           E_GENERAL;
+uid_t       metaUid     =           E_GENERAL;
+gid_t       metaGid     =           E_GENERAL;
+int64_t     metaTime    =           E_GENERAL;
 
 	// Buffers for storing paths for each function
-char        *createPath;
-char        *deletePath;
-char        *oldPath;
-char        *newPath;
-char        *appendPath;
 char        *writePath;
-char        *appendBuffer;
 char        *logFileName;
+char        *statsFileName;
+char        *messageStream  =       "stdout";   // "stderr" while an archive is written to stdout
+
+// Operations given on the command line, in the order they were given
+struct Operation    *operations     =   NULL;
+int                 operationCount  =   0;
 
 // Buffer for storing values to read and write
 char        readBuffer              [MAX_APPEND_SIZE];
 char        writeBuffer             [MAX_APPEND_SIZE];
 
+// Bump allocator for short lived strings and buffers. Every thread owns one
+// (threadArena), so allocation never takes a lock. Memory is handed back in 
+// bulk by restoring a mark taken with ArenaSave.
+struct 
+ArenaBlock {
+    struct ArenaBlock   *previous;  /* Block that was current before this one */
+    size_t              used;       /* Bytes handed out from data */
+    size_t              size;       /* Capacity of data */
+    char                data[];
+};
+
+struct 
+Arena {
+    struct ArenaBlock   *current;   /* Block new allocations are taken from */
+};
+
+struct 
+ArenaMark {
+    struct ArenaBlock   *block;     /* Current block at the time of the mark */
+    size_t              used;       /* Its fill level at the time of the mark */
+};
+
+// Growable path that tracks its own length, so components can be pushed and
+// popped in O(1) while walking a tree. There is no limit on the length.
+struct 
+PathBuilder {
+    char                *path;      /* Null terminated path */
+    size_t              length;     /* strlen(path) */
+    size_t              capacity;   /* Allocated size of path */
+};
+
+__thread struct Arena   threadArena;
+
+// Parallel directory walk. Directories are kept on a shared LIFO stack and 
+// opened relative to their parent's fd when a worker picks them up. A node 
+// keeps its fd open until all of its children are done (pending drops to 0),
+// so children and the leave callback can always work relative to it.
+struct 
+WalkNode {
+    struct WalkNode *parent;        /* NULL for the root */
+    int             fd;             /* Directory fd, open while pending > 0 */
+    int             pending;        /* 1 for its own scan plus one per unfinished child */
+    int             modified;       /* Set by callbacks that removed something inside */
+    size_t          nameLength;
+    char            name[];         /* Component name, the full root path for the root */
+};
+
+struct Walker;
+typedef int  (*WalkVisitor)         (struct Walker *, struct WalkNode *, char *, unsigned char);
+typedef void (*WalkLeaver)          (struct Walker *, struct WalkNode *);
+
+struct 
+Walker {
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;        /* Signalled when work is pushed or the walk ends */
+    struct WalkNode **stack;        /* Directories waiting to be scanned */
+    long            count;
+    long            capacity;
+    long            outstanding;    /* Nodes pushed but not yet scanned, including running ones */
+    WalkVisitor     visit;          /* Called for every entry, WALK_DESCEND to enter a directory */
+    WalkLeaver      leave;          /* Called once a directory and everything below it is done, may be NULL */
+    void            *context;
+    int             status;         /* First error encountered */
+};
+
+// One entry of a tree compared by --sync
+struct 
+SyncEntry {
+    char            *path;          /* Path relative to the tree root */
+    off_t           size;
+    int64_t         mtimeSeconds;
+    uint32_t        mtimeNanoseconds;
+    dev_t           device;
+    ino_t           inode;
+    mode_t          mode;
+    int             hashed;         /* hash holds the content hash */
+    int             matched;        /* Used as source of a rename */
+    int             queued;         /* Already queued for hashing */
+    uint64_t        hash;
+};
+
+struct 
+SyncTree {
+    char            *root;
+    int             fd;             /* Root directory, every action is relative to it */
+    pthread_mutex_t lock;           /* Guards entries and arena while scanning */
+    struct Arena    arena;          /* Storage for entry paths */
+    struct SyncEntry *entries;
+    long            count;
+    long            capacity;
+    int             threads;        /* Walk workers for this tree */
+    int             status;
+};
+
+// An action of the sync plan. source is the entry in the source tree and 
+// target the entry in the target tree, either may be NULL.
+struct 
+SyncAction {
+    struct SyncEntry *source;
+    struct SyncEntry *target;
+    off_t           length;         /* Bytes to compare for SYNC_CHECK */
+    int             same;           /* Result of SYNC_CHECK */
+};
+
+struct 
+SyncPlan {
+    struct SyncAction *actions[SYNC_PHASES + 1]; /* One list per action type, run in this order, then SYNC_CHECK */
+    long            count[SYNC_PHASES + 1];
+    long            capacity[SYNC_PHASES + 1];
+};
+
+// Filesystems with changes that still have to be committed in batch 
+// durability mode. One directory fd is kept open per filesystem for syncfs.
+struct 
+DurableBatch {
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;           /* Wakes the commit timer early to stop it */
+    dev_t           devices[MAX_BATCH_FILESYSTEMS];
+    int             fds[MAX_BATCH_FILESYSTEMS];
+    int             count;
+    long            operations;     /* Changes since the last commit */
+    time_t          lastCommit;
+    int             stop;           /* Set when the commit timer has to finish */
+    int             status;         /* First error of a commit made by the timer */
+};
+
+struct DurableBatch     durableBatch    =   {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+// A file that may be deleted by --gc
+struct 
+GcCandidate {
+    int64_t         time;           /* atime or mtime in seconds */
+    off_t           bytes;          /* Space it takes on disk */
+    char            *path;          /* Path relative to the gc root */
+};
+
+// State of one garbage collection round. The candidates form a max-heap on
+// time holding the oldest files seen so far, so memory stays bounded no 
+// matter how large the tree is.
+struct 
+GcJob {
+    char            *root;
+    pthread_mutex_t lock;           /* Guards the heap */
+    struct GcCandidate *heap;
+    long            count;
+    int64_t         newest;         /* Time of the heap top once full, read without the lock */
+    int             overflowed;     /* Files were left out because the heap was full */
+    int             collect;        /* A size target was given, remember candidates */
+    int64_t         cutoff;         /* Files older than this are deleted during the walk, 0 for none */
+    off_t           totalBytes;     /* Size of the files that are kept */
+    off_t           freedBytes;
+    long            deletedFiles;
+    long            prunedDirectories;
+};
+
+// Live counters published with --stats and read by --top. The page is a
+// file mapped by both processes. Each counter sits on its own cache line.
+struct 
+StatsCounter {
+    uint64_t        value;
+    char            padding[STATS_CACHE_LINE - sizeof(uint64_t)];
+};
+
+struct 
+StatsPage {
+    char            magic[8];       /* STATS_MAGIC once the header is complete */
+    int64_t         pid;
+    int64_t         startTime;      /* Seconds since the epoch */
+    int             finished;       /* Set when the job is done */
+    uint64_t        freeAtStart;    /* Free bytes on the filesystem of the watched path */
+    uint64_t        watchLength;    /* Length of the watched path, stored right after the page, 0 for none */
+    struct StatsCounter counters[STATS_COUNTERS] __attribute__((aligned(STATS_CACHE_LINE)));
+};
+
+struct StatsPage    *statsPage      =   NULL;
+size_t              statsPageSize   =   0;      // Mapped size, the page and the watched path
+
+// One file of an append to many files. The same file reached through
+// different paths has the same device and inode, so it gets one writer.
+struct 
+FanOutTarget {
+    char            *path;
+    dev_t           device;         /* 0 if the file could not be looked up */
+    ino_t           inode;
+    uint64_t        hash;           /* Of device and inode, or of the path without them, picks the worker */
+};
+
+// Shared state of an append to many files
+struct 
+FanOutJob {
+    struct FanOutTarget *targets;   /* In order, a file may appear more than once */
+    long            count;
+    long            capacity;
+    char            *listBuffer;    /* Contents of an @listfile, paths point into it */
+    char            *payload;
+    size_t          payloadLength;
+    int             threadCount;
+    int             poolSize;       /* Open fds per worker */
+    int             status;
+    long            files;          /* Writes done, one per file and window */
+    long            records;
+};
+
+struct 
+FanOutWorker {
+    struct FanOutJob *job;
+    int             index;          /* Handles the targets whose hash maps to it */
+};
+
+// An open target in a fan-out worker's fd pool
+struct 
+AppendPoolEntry {
+    struct FanOutTarget *target;
+    int             fd;             /* E_GENERAL for a free slot */
+    long            lastUse;        /* Worker's use counter at the last write */
+};
+
+// Counters of a --meta run, updated atomically by the walk workers
+struct 
+MetaJob {
+    char            *root;          /* Root as given, for logging */
+    long            changed;
+    long            unchanged;
+};
+
+// Shared state for the workers of SyncRunPhase
+struct 
+SyncPhaseJob {
+    struct SyncTree *source;
+    struct SyncTree *target;
+    struct SyncAction *actions;
+    long            count;
+    long            next;           /* Next action to hand out, taken atomically */
+    int             type;
+    int             status;
+};
+
+// Header block of a tar archive
+struct 
+TarHeader {
+    char            name[100];
+    char            mode[8];
+    char            uid[8];
+    char            gid[8];
+    char            size[12];
+    char            mtime[12];
+    char            chksum[8];
+    char            typeflag;
+    char            linkname[100];
+    char            magic[6];
+    char            version[2];
+    char            uname[32];
+    char            gname[32];
+    char            devmajor[8];
+    char            devminor[8];
+    char            prefix[155];
+    char            pad[12];
+};
+
+// Buffered output of --pack
+struct 
+PackStream {
+    int             fd;
+    char            *buffer;
+    size_t          used;
+    int             status;         /* First error on a file that could not be packed */
+    dev_t           skipDevice;     /* The archive itself, when it is inside the tree */
+    ino_t           skipInode;
+};
+
+// Buffered input of --unpack
+struct 
+UnpackStream {
+    int             fd;
+    char            *buffer;
+    size_t          start;          /* First unread byte of buffer */
+    size_t          end;            /* End of the data in buffer */
+};
+
+// A small file read from the archive, waiting to be created by a worker
+struct 
+UnpackJob {
+    struct UnpackJob *next;
+    mode_t          mode;
+    int64_t         mtime;
+    size_t          size;
+    char            *name;          /* Both point into the same allocation as the job */
+    char            *data;
+};
+
+// Shared state of the reader and the workers of UnpackArchive
+struct 
+UnpackQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;        /* Signalled when a job is queued or finished */
+    struct UnpackJob *head;
+    struct UnpackJob *tail;
+    size_t          queuedBytes;
+    int             rootFd;         /* Target directory, every file is created relative to it */
+    int             done;           /* The reader has queued everything */
+    int             status;
+    uint64_t        *names;         /* Hashes of the file names read so far, 0 for a free slot, reader only */
+    size_t          nameCount;
+    size_t          nameCapacity;
+};
+
+// A symbolic or hard link, or a directory whose final mode and mtime are 
+// not set yet, kept until every file of the archive is extracted
+struct 
+UnpackDeferred {
+    struct UnpackDeferred *next;
+    char            type;           /* TAR_SYMLINK, TAR_HARDLINK or TAR_DIRECTORY */
+    mode_t          mode;
+    int64_t         mtime;
+    char            *target;        /* Link target, relative to the target directory for a hard link */
+    char            name[];
+};
+
 // Function Declarations
 int         ProcessCommandLine      (char **, int);
-int         CheckDirectory          (char *);
-int         NonBlockingOperation    (ssize_t (*) (int, void *, size_t), int, char *, void*, int, int );
+int         CheckDirectory          (char *, int *);
+int         NonBlockingOperation    (ssize_t (*) (int, void *, size_t), int, char *, void*, int, int, int);
 int         AppendEvenNumbers       (int, char *);
 int         AppendText              (char *, char*);
+int         EvenNumbersPayload      (int, short int *);
+int         FanOutAppend            (char *, char *, int);
+int         FanOutCollect           (struct FanOutJob *, char *);
+int         FanOutAddTarget         (struct FanOutJob *, char *, size_t, int, struct stat *);
+int         FanOutSameTarget        (struct FanOutTarget *, struct FanOutTarget *);
+int         IsFanOutSpec            (char *);
+void *      FanOutWorker            (void *);
+int         FanOutWrite             (struct FanOutJob *, struct AppendPoolEntry *, long, long, struct iovec *, int);
 int         CreateFile              (char *);
 int         CreateDirectory         (char *);
 int         RemoveFile              (char *);
 int         RemoveDirectory         (char *);
 int         RenameDirectory         (char *, char *);
 int         RenameFile              (char *, char *);
+int         SwapDirectories         (char *, char *, int);
+int         ReapDirectory           (char *);
 int         PerformOperations       ();
+int         AddOperation            (int, char *, char *);
+int         ExecuteOperation        (struct Operation *);
+void *      OperationWorker         (void *);
+int         OperationsConflict      (struct Operation *, struct Operation *);
+int         PathsOverlap            (char *, char *);
+int         IsNumberedPath          (char *, char *);
+char *      NormalizePath           (char *, char *);
+int         ReportOperation         (int, struct Operation *);
+int         PrintMessage            (const char *, ...);
+char *      JoinParts               (size_t *, const char *, va_list);
+int         ProcessLongOption       (char **, int, int);
+int         CheckOptions            ();
+void        SetFirstError           (int *, int);
+int         WalkTree                (char *, WalkVisitor, WalkLeaver, void *, int);
+void *      WalkWorker              (void *);
+void        WalkRelease             (struct Walker *, struct WalkNode *);
+int         WalkRelativePath        (struct WalkNode *, struct PathBuilder *);
+int         OpenParentBeneath       (int, char *, int, int, char **);
+int         ComparePaths            (const char *, const char *);
+int         SyncTrees               (char *, char *);
+void *      SyncScanTree            (void *);
+int         SyncVisit               (struct Walker *, struct WalkNode *, char *, unsigned char);
+int         SyncAddEntry            (struct SyncTree *, char *, struct statx *);
+int         SyncPlan                (struct SyncTree *, struct SyncTree *, struct SyncPlan *);
+int         SyncAddAction           (struct SyncPlan *, int, struct SyncEntry *, struct SyncEntry *);
+int         SyncMatchMoves          (struct SyncTree *, struct SyncTree *, struct SyncPlan *, struct SyncEntry **, long);
+int         SyncSameContent         (struct SyncTree *, struct SyncEntry *, struct SyncTree *, struct SyncEntry *, off_t);
+int         SyncHash                (struct SyncTree *, struct SyncEntry *, off_t, uint64_t *);
+int         SyncRunPhase            (struct SyncTree *, struct SyncTree *, struct SyncAction *, long, int);
+void *      SyncActionWorker        (void *);
+void        SyncCheckContent        (struct SyncPhaseJob *, struct SyncAction *);
+int         SyncExecute             (struct SyncPhaseJob *, struct SyncAction *, struct PathBuilder *, struct PathBuilder *);
+int         SyncRemove              (int, char *, int, struct PathBuilder *);
+int         CopyFileContents        (int, char *, int, char *, off_t, struct SyncEntry *, char *, char *);
+int         DurableFile             (int, char *);
+int         DurableDirectory        (int, char *);
+int         DurableParent           (char *, char *);
+int         DurableRegister         (dev_t, int, char *);
+int         DurableCommit           ();
+void *      DurableTimer            (void *);
+size_t      ParentLength            (char *);
+int         GarbageCollect          (char *);
+int         GcVisit                 (struct Walker *, struct WalkNode *, char *, unsigned char);
+void        GcLeave                 (struct Walker *, struct WalkNode *);
+int         GcOffer                 (struct GcJob *, int64_t, off_t, struct WalkNode *, char *);
+void        GcSiftDown              (struct GcCandidate *, long, long);
+int         GcDeleteOldest          (struct GcJob *, off_t, off_t *);
+void        GcPruneParents          (int, int, struct PathBuilder *, size_t, struct GcJob *);
+long        ParseDuration           (char *);
+int         ParseOwner              (char *, uid_t *, gid_t *);
+int         StatsOpen               ();
+void        StatsClose              ();
+void        StatsAdd                (int, long);
+int         StatsTop                (char *);
+size_t      StatsField              (char *, size_t, const char *, long, const char *);
+char *      StatsDefaultName        (char *);
+int         UpdateMetadata          (char *);
+int         MetaVisit               (struct Walker *, struct WalkNode *, char *, unsigned char);
+void        MetaLeave               (struct Walker *, struct WalkNode *);
+void        MetaApply               (struct Walker *, struct WalkNode *, char *);
+int         PackTree                (char *, char *);
+int         PackDirectory           (int, struct PathBuilder *, struct PackStream *);
+int         PackEntry               (struct PackStream *, int, char *, int, struct PathBuilder *);
+int         PackHeader              (struct PackStream *, char *, char, struct stat *, off_t, char *);
+int         PackLongRecord          (struct PackStream *, char, char *, size_t);
+int         PackWrite               (struct PackStream *, void *, size_t);
+int         PackFlush               (struct PackStream *);
+void        TarNumber               (char *, size_t, uint64_t);
+uint64_t    TarParseNumber          (char *, size_t);
+unsigned int TarChecksum            (struct TarHeader *);
+int         UnpackArchive           (char *, char *);
+int         UnpackSafeName          (char *);
+int         UnpackQueueFile         (struct UnpackQueue *, struct UnpackStream *, char *, mode_t, int64_t, off_t);
+int         UnpackWaitRepeated      (struct UnpackQueue *, char *);
+void *      UnpackWorker            (void *);
+int         UnpackLargeFile         (struct UnpackQueue *, struct UnpackStream *, char *, mode_t, int64_t, off_t);
+int         UnpackCreate            (int, char *, mode_t);
+int         UnpackDefer             (struct UnpackDeferred **, char, char *, char *, mode_t, int64_t);
+int         UnpackRestore           (int, struct UnpackDeferred *);
+int         UnpackFinish            (int, mode_t, int64_t, char *);
+int         UnpackRead              (struct UnpackStream *, void *, size_t);
+int         UnpackSkip              (struct UnpackStream *, off_t);
 int         Help                    ();
 int         BulkDeleteDirectory     (char *);
-int         CreateLog               (char *);
+int         CreateLog               (char *, size_t);
+int         LogMessage              (const char *, ...);
 char *      GetErrorMessage         (int);
+int         SizeFile                (int, char *);
+int         BulkCreate              (char *, long, int);
+void *      BulkCreateWorker        (void *);
+int         GetThreadCount          (long);
+off_t       ParseSize               (char *);
+int         BulkDeleteAt            (int, struct PathBuilder *);
+int         RaiseFileLimit          ();
+void *      ArenaAlloc              (struct Arena *, size_t);
+void        ArenaRestore            (struct Arena *, struct ArenaMark);
+struct ArenaMark ArenaSave          (struct Arena *);
+int         PathInit                (struct PathBuilder *, const char *);
+int         PathPush                (struct PathBuilder *, const char *, size_t);
+int         PathAppend              (struct PathBuilder *, const char *, size_t);
+void        PathPop                 (struct PathBuilder *, size_t);
+void        PathFree                (struct PathBuilder *);
+int         ChmodAt                 (int, char *, mode_t);
+int         FormatLong              (char *, long);
+
+// A directory that BulkDeleteAt went down from, to come back to later
+struct 
+DeleteFrame {
+    off_t           offset;         /* getdents position after the entry we went into */
+    dev_t           device;         /* Identity of the directory, checked on the way back */
+    ino_t           inode;
+    size_t          pathLength;     /* Length of its path in the path builder */
+    size_t          nameOffset;     /* Where the name of the entry we went into starts */
+};
+
+// Shared state for the workers of BulkCreate
+struct 
+BulkCreateJob {
+    char            *prefix;        /* Path prefix, files are named <prefix>.<index> */
+    long            count;          /* Total number of entries to create */
+    long            next;           /* Next index to hand out, taken atomically */
+    int             status;         /* First error encountered by any worker */
+    int             directory;      /* Create directories instead of files */
+};
+
+// One operation from the command line. Operations on overlapping paths run in
+// command line order, everything else may run at the same time.
+struct 
+Operation {
+    int             type;           /* OP_CREATE, OP_DELETE, OP_RENAME or OP_APPEND */
+    char            *path;          /* Path to operate on, old path for rename */
+    char            *newPath;       /* New path for rename, NULL otherwise */
+    char            *appendBuffer;  /* Text or start number for append */
+    int             binary;         /* Append even numbers instead of text */
+    int             directory;      /* Create a directory instead of a file */
+    int             reap;           /* Remove the old tree in the background after a swap */
+    char            *keys[2];       /* Absolute normalized paths used for conflict checks */
+    int             blockers;       /* Earlier conflicting operations still to finish */
+    int             status;         /* Result of the operation */
+};
+
+// Shared state for the workers of PerformOperations
+struct 
+OperationQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;        /* Signalled whenever an operation finishes */
+    int             *ready;         /* Indices of operations whose blockers are done */
+    int             head;           /* Next entry of ready to hand out */
+    int             tail;           /* Next free slot of ready */
+    int             finished;       /* Number of operations that have completed */
+};
 
 struct 
 linux_dirent64 {
@@ -90,8 +677,17 @@ main(int argc, char *argv[])
             ec = Help();
     else
     {
+        RaiseFileLimit();
         ec = ProcessCommandLine(argv, argc);
+        if (ec != E_OK)
+        {
+            Help();     // Malformed input, run nothing rather than part of it
+            return EINVAL;
+        }
+        if (fStats)
+            StatsOpen();
         ec = PerformOperations();
+        StatsClose();
     }
     return ec;
 }
@@ -108,37 +704,49 @@ int
 ProcessCommandLine(char *commandLineArguments[], int argCount)
 {
     int argno = 1;
+    int lastCreate = E_GENERAL;
+    int lastAppend = E_GENERAL;
+    int pendingDirectory = DISABLE;
+    int pendingBinary = DISABLE;
+    char *pendingBuffer = NULL;
     while(argno < argCount)
     {
         switch (commandLineArguments[argno][1])
         {
         case 'c':
-            fCreate = ENABLE;
             if (argno + 1 == argCount)
                 return E_GENERAL;
-            createPath = commandLineArguments[argno + 1];
+            lastCreate = AddOperation(OP_CREATE, commandLineArguments[argno + 1], NULL);
+            if (lastCreate == E_GENERAL)
+                return E_GENERAL;
+            operations[lastCreate].directory = pendingDirectory;
+            pendingDirectory = DISABLE;
             argno += 2;
             break;
         case 'd':
-            fDelete = ENABLE;
             if (argno + 1 == argCount)
                 return E_GENERAL;
-            deletePath = commandLineArguments[argno + 1];
+            if (AddOperation(OP_DELETE, commandLineArguments[argno + 1], NULL) == E_GENERAL)
+                return E_GENERAL;
             argno += 2;
             break;
         case 'r':
-            fRename = ENABLE;
-            if (argno + 2 == argCount)
+            if (argno + 2 >= argCount)
+                return E_GENERAL;
+            if (AddOperation(OP_RENAME, commandLineArguments[argno + 1], commandLineArguments[argno + 2]) == E_GENERAL)
                 return E_GENERAL;
-            oldPath = commandLineArguments[argno + 1];
-            newPath = commandLineArguments[argno + 2];
             argno += 3;
             break;
         case 'a':
-            fAppend = ENABLE;
             if (argno + 1 == argCount)
                 return E_GENERAL;
-            appendPath = commandLineArguments[argno + 1];
+            lastAppend = AddOperation(OP_APPEND, commandLineArguments[argno + 1], NULL);
+            if (lastAppend == E_GENERAL)
+                return E_GENERAL;
+            operations[lastAppend].appendBuffer = pendingBuffer;
+            operations[lastAppend].binary = pendingBinary;
+            pendingBuffer = NULL;       // Taken, the next -a needs its own -s / -e
+            pendingBinary = DISABLE;
             argno += 2;
             break;
         case 'l':
@@ -149,28 +757,285 @@ ProcessCommandLine(char *commandLineArguments[], int argCount)
             argno += 2;
             break;
         case 'e':
-            fBinary = ENABLE;
+        case 's':
+            if (argno + 1 == argCount)
+                return E_GENERAL;
+            // -s / -e belong to the last -a, or to the next one if none was given yet
+            if (lastAppend != E_GENERAL)
+            {
+                operations[lastAppend].appendBuffer = commandLineArguments[argno + 1];
+                operations[lastAppend].binary = commandLineArguments[argno][1] == 'e';
+            }
+            else
+            {
+                pendingBuffer = commandLineArguments[argno + 1];
+                pendingBinary = commandLineArguments[argno][1] == 'e';
+            }
+            argno += 2;
+            break;
+        case 'f':
+            if (lastCreate != E_GENERAL)        // -f belongs to the last -c, or to the next one if none was given yet
+                operations[lastCreate].directory = ENABLE;
+            else
+                pendingDirectory = ENABLE;
+            argno += 1;
+            break;
+        case 'm':
+        {
             if (argno + 1 == argCount)
                 return E_GENERAL;
-            appendBuffer = commandLineArguments[argno + 1];
+            char *end;
+            long mode = strtol(commandLineArguments[argno + 1], &end, 8);  // Mode is given in octal, e.g. 644
+            if (end == commandLineArguments[argno + 1] || *end != '\0' || mode < 0 || mode > 07777)
+                return E_GENERAL;
+            createMode = mode;
             argno += 2;
             break;
-        case 's':
+        }
+        case 'z':
             if (argno + 1 == argCount)
                 return E_GENERAL;
-            appendBuffer = commandLineArguments[argno + 1];
+            createSize = ParseSize(commandLineArguments[argno + 1]);
+            if (createSize < 0)
+                return E_GENERAL;
             argno += 2;
             break;
-        case 'f':
-            fDirectory = ENABLE;
+        case 'p':
+            fPreallocate = ENABLE;
             argno += 1;
             break;
+        case 'k':
+            fPreallocate = ENABLE;  // Keeping the size only makes sense for preallocated files
+            fKeepSize = ENABLE;
+            argno += 1;
+            break;
+        case 'n':
+        {
+            if (argno + 1 == argCount)
+                return E_GENERAL;
+            char *end;
+            errno = E_OK;
+            createCount = strtol(commandLineArguments[argno + 1], &end, 10);
+            if (end == commandLineArguments[argno + 1] || *end != '\0' || errno == ERANGE || createCount < 1)
+                return E_GENERAL;
+            argno += 2;
+            break;
+        }
+        case 'j':
+        {
+            if (argno + 1 == argCount)
+                return E_GENERAL;
+            char *end;
+            long threads = strtol(commandLineArguments[argno + 1], &end, 10);
+            if (end == commandLineArguments[argno + 1] || *end != '\0' || threads < 1 || threads > INT_MAX)
+                return E_GENERAL;
+            nThreads = threads;     // Still capped at MAX_THREADS by GetThreadCount
+            argno += 2;
+            break;
+        }
+        case '-':
+        {
+            int used = ProcessLongOption(commandLineArguments, argno, argCount);
+            if (used == E_GENERAL)
+                return E_GENERAL;
+            argno += used;
+            break;
+        }
         default:
-            return E_OK;
+            return CheckOptions();
             break;
         }
     } 
-    return E_OK; 
+    return CheckOptions(); 
+}
+
+//  function: CheckOptions
+//      Checks the combinations of options that can only be judged once the
+//      whole command line is read, since options may follow the operation
+//  @param: None
+//  @return: Integer error code, E_GENERAL for a combination that does nothing
+int
+CheckOptions()
+{
+    for (int i = 0; i < operationCount; i ++)
+    {
+        if (operations[i].type == OP_GC && gcTtl < 0 && gcMaxSize < 0 && gcMinFree < 0)
+            return E_GENERAL;       // --gc without any budget would walk the tree and delete nothing
+    }
+    return E_OK;
+}
+
+// function: ProcessLongOption
+//      Handles the options that are spelled out, e.g. --sync
+//  @param: commandLineArguments - Pointer to array containing command line 
+//          arguments
+//  @param: argno - Integer position of the option
+//  @param: argCount - Integer count of total number of command line arguments
+//  @return: number of arguments used, E_GENERAL on malformed input
+int
+ProcessLongOption(char *commandLineArguments[], int argno, int argCount)
+{
+    char *option = commandLineArguments[argno] + 2;
+    if (strcmp(option, "sync") == 0)
+    {
+        if (argno + 2 >= argCount)
+            return E_GENERAL;
+        if (AddOperation(OP_SYNC, commandLineArguments[argno + 1], commandLineArguments[argno + 2]) == E_GENERAL)
+            return E_GENERAL;
+        return 3;
+    }
+    if (strcmp(option, "gc") == 0)
+    {
+        if (argno + 1 == argCount)
+            return E_GENERAL;
+        if (AddOperation(OP_GC, commandLineArguments[argno + 1], NULL) == E_GENERAL)
+            return E_GENERAL;
+        return 2;
+    }
+    if (strcmp(option, "pack") == 0 || strcmp(option, "unpack") == 0)
+    {
+        if (argno + 2 >= argCount)
+            return E_GENERAL;
+        int type = option[0] == 'p' ? OP_PACK : OP_UNPACK;
+        if (AddOperation(type, commandLineArguments[argno + 1], commandLineArguments[argno + 2]) == E_GENERAL)
+            return E_GENERAL;
+        if (type == OP_PACK && strcmp(commandLineArguments[argno + 2], "-") == 0)
+            messageStream = "stderr";       // Keep reports out of the archive
+        return 3;
+    }
+    if (strcmp(option, "stats") == 0)
+    {
+        fStats = ENABLE;
+        return 1;
+    }
+    if (strcmp(option, "stats-file") == 0)
+    {
+        if (argno + 1 == argCount)
+            return E_GENERAL;
+        fStats = ENABLE;
+        statsFileName = commandLineArguments[argno + 1];
+        return 2;
+    }
+    if (strcmp(option, "top") == 0)
+    {
+        if (argno + 1 == argCount)
+            return E_GENERAL;
+        if (AddOperation(OP_TOP, commandLineArguments[argno + 1], NULL) == E_GENERAL)
+            return E_GENERAL;
+        return 2;
+    }
+    if (strcmp(option, "swap") == 0)
+    {
+        if (argno + 2 >= argCount)
+            return E_GENERAL;
+        if (AddOperation(OP_SWAP, commandLineArguments[argno + 1], commandLineArguments[argno + 2]) == E_GENERAL)
+            return E_GENERAL;
+        return 3;
+    }
+    if (strcmp(option, "reap") == 0)
+    {
+        // Belongs to the --swap right before it
+        if (operationCount == 0 || operations[operationCount - 1].type != OP_SWAP)
+            return E_GENERAL;
+        operations[operationCount - 1].reap = ENABLE;
+        return 1;
+    }
+    if (strcmp(option, "meta") == 0)
+    {
+        if (argno + 1 == argCount)
+            return E_GENERAL;
+        if (AddOperation(OP_META, commandLineArguments[argno + 1], NULL) == E_GENERAL)
+            return E_GENERAL;
+        return 2;
+    }
+    if (strcmp(option, "chmod") == 0)
+    {
+        if (argno + 1 == argCount)
+            return E_GENERAL;
+        char *end;
+        metaMode = strtol(commandLineArguments[argno + 1], &end, 8);   // Octal, like -m
+        if (*end != '\0' || end == commandLineArguments[argno + 1] || metaMode < 0 || metaMode > 07777)
+            return E_GENERAL;
+        return 2;
+    }
+    if (strcmp(option, "chown") == 0)
+    {
+        if (argno + 1 == argCount)
+            return E_GENERAL;
+        if (ParseOwner(commandLineArguments[argno + 1], &metaUid, &metaGid) == E_GENERAL)
+            return E_GENERAL;
+        return 2;
+    }
+    if (strcmp(option, "touch") == 0)
+    {
+        if (argno + 1 == argCount)
+            return E_GENERAL;
+        char *end;
+        if (strcmp(commandLineArguments[argno + 1], "now") == 0)
+            metaTime = time(NULL);
+        else
+        {
+            metaTime = strtoll(commandLineArguments[argno + 1], &end, 10);     // Seconds since the epoch
+            if (*end != '\0' || end == commandLineArguments[argno + 1] || metaTime < 0)
+                return E_GENERAL;
+        }
+        return 2;
+    }
+    if (strcmp(option, "max-size") == 0 || strcmp(option, "min-free") == 0)
+    {
+        if (argno + 1 == argCount)
+            return E_GENERAL;
+        off_t size = ParseSize(commandLineArguments[argno + 1]);
+        if (size < 0)
+            return E_GENERAL;
+        if (option[1] == 'a')
+            gcMaxSize = size;
+        else
+            gcMinFree = size;
+        return 2;
+    }
+    if (strcmp(option, "ttl") == 0)
+    {
+        if (argno + 1 == argCount)
+            return E_GENERAL;
+        gcTtl = ParseDuration(commandLineArguments[argno + 1]);
+        if (gcTtl < 0)
+            return E_GENERAL;
+        return 2;
+    }
+    if (strcmp(option, "by") == 0)
+    {
+        if (argno + 1 == argCount)
+            return E_GENERAL;
+        if (strcmp(commandLineArguments[argno + 1], "atime") == 0)
+            fGcByAtime = ENABLE;
+        else if (strcmp(commandLineArguments[argno + 1], "mtime") == 0)
+            fGcByAtime = DISABLE;
+        else
+            return E_GENERAL;
+        return 2;
+    }
+    if (strcmp(option, "checksum") == 0)
+    {
+        fChecksum = ENABLE;
+        return 1;
+    }
+    if (strcmp(option, "durability") == 0)
+    {
+        if (argno + 1 == argCount)
+            return E_GENERAL;
+        char *level = commandLineArguments[argno + 1];
+        if (strcmp(level, "none") == 0)
+            durability = DURABILITY_NONE;
+        else if (strcmp(level, "batch") == 0)
+            durability = DURABILITY_BATCH;
+        else if (strcmp(level, "strict") == 0)
+            durability = DURABILITY_STRICT;
+        else
+            return E_GENERAL;
+        return 2;
+    }
+    return E_GENERAL;
 }
 
 
@@ -182,17 +1047,23 @@ ProcessCommandLine(char *commandLineArguments[], int argCount)
 int 
 Help()
 {
-    char *helpMessage = "\tUsage:\n\t./my_bfm -c <Path> -a <TextFilePath> -s <string to append> OR -e <number to append> -r <OldPath> <NewPath> -d <Path> -l <log file>\n\tFor more info, please refer to README file\n";
+    char *helpMessage = "\tUsage:\n\t./my_bfm -c <Path> -a <TextFilePath> -s <string to append> OR -e <number to append> -r <OldPath> <NewPath> -d <Path> -l <log file>\n"
+                        "\tCreate options: -f (directory) -m <octal mode> -z <size[K|M|G]> -p (preallocate) -k (preallocate, keep size) -n <count> -j <threads>\n"
+                        "\t--sync <SourceDir> <TargetDir> [--checksum]\n"
+                        "\t--durability none|batch|strict\n"
+                        "\t--gc <Dir> [--max-size <size>] [--min-free <size>] [--ttl <age[s|m|h|d]>] [--by atime|mtime]\n"
+                        "\t--stats OR --stats-file <File> (publish progress), --top <Pid|File> (follow it)\n"
+                        "\t--swap <StagedDir> <LiveDir> [--reap]\n"
+                        "\t--meta <Dir> [--chmod <octal mode>] [--chown <user>[:<group>]] [--touch <epoch seconds>|now]\n"
+                        "\t--pack <Dir> <Archive|-> OR --unpack <Archive|-> <Dir>\n"
+                        "\tFor more info, please refer to README file\n";
     int length = strlen(helpMessage);
     int error = write(STDOUT_FILENO, helpMessage, length);
     if (error == E_GENERAL)
     {
-        char *errorMessage = GetErrorMessage(errno);
-        int errorCode = errno;
-        char buffer[BUF_SIZE] = "\nFailed to print Help Message: ";
-        errorMessage = strcat(buffer, errorMessage);
+        error = errno;
         if (fLog)
-            error = CreateLog(errorMessage);
+            LogMessage("\nFailed to print Help Message: ", GetErrorMessage(error), NULL);
         return error;
     }
 
@@ -200,136 +1071,356 @@ Help()
     {
         error = E_OK;
         if (fLog)
-            error = CreateLog("\nPrinted Help Message");
+            error = LogMessage("\nPrinted Help Message", NULL);
         return error;
     }
 }
 
 
 //  function: PerformOperations
-//      This function calls and executes appropriate functions based on
-//      which flags were set after processing command line.
+//      Runs all operations given on the command line on a pool of threads.
+//      An operation only waits for earlier operations whose paths overlap with
+//      its own, so independent operations run concurrently while dependent ones
+//      keep command line order. Every operation runs and is reported.
 //  @param: None
-//  @return: Integer Error Code
+//  @return: Integer Error Code of the first failed operation in command line
+//           order, E_OK if all succeeded
 int 
 PerformOperations()
 {
+    pthread_t threads[MAX_THREADS];
+    struct OperationQueue queue;
     int status = E_OK;
-    
-    if (fCreate)
+    if (operationCount == 0)
+        return E_OK;
+    queue.ready = malloc(operationCount * sizeof(int));
+    if (queue.ready == NULL)
+        return ENOMEM;
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.changed, NULL);
+    queue.head = queue.tail = queue.finished = 0;
+    for (int i = 0; i < operationCount; i ++)
     {
-        if(fDirectory)
-        {
-            status = CreateDirectory(createPath);
-            if (status != E_OK)
-                return status;
-            fDirectory = DISABLE;
-        }
-        else 
-        {
-            status = CreateFile(createPath);
-            if(status != E_OK)
-                return status;
-        }
+        operations[i].blockers = 0;
+        for (int j = 0; j < i; j ++)
+            operations[i].blockers += OperationsConflict(&operations[j], &operations[i]);
+        if (operations[i].blockers == 0)
+            queue.ready[queue.tail ++] = i;
     }
-    if (fRename)
+
+    pthread_t timer;
+    int timerStarted = durability == DURABILITY_BATCH && pthread_create(&timer, NULL, DurableTimer, NULL) == E_OK;
+    int threadCount = GetThreadCount(operationCount);
+    int started = 0;
+    for (; started < threadCount; started ++)
     {
-        status = CheckDirectory(oldPath);   
-        if (status != E_OK)
-            return status;
-        if (fDirectory)
-        {
-            status = RenameDirectory(oldPath, newPath);
-            if (status != E_OK)
-                return status;
-            fDirectory = DISABLE;
-        }
-        else
-        {
-            status = RenameFile(oldPath, newPath);
-            if (status != E_OK)
-                return status;
-        }
+        if (pthread_create(&threads[started], NULL, OperationWorker, &queue) != E_OK)
+            break;
     }
-
-    if (fAppend)
+    if (started == 0)
+        OperationWorker(&queue);
+    for (int i = 0; i < started; i ++)
+        pthread_join(threads[i], NULL);
+    pthread_cond_destroy(&queue.changed);
+    pthread_mutex_destroy(&queue.lock);
+    free(queue.ready);
+    if (timerStarted)
     {
-        status = CheckDirectory(appendPath);
-        if (status != E_OK)
-            return status;
+        pthread_mutex_lock(&durableBatch.lock);
+        durableBatch.stop = ENABLE;
+        pthread_cond_signal(&durableBatch.wake);
+        pthread_mutex_unlock(&durableBatch.lock);
+        pthread_join(timer, NULL);
+    }
+    int commitStatus = durability == DURABILITY_BATCH ? DurableCommit() : E_OK;     // Final commit point
+    if (commitStatus == E_OK)
+        commitStatus = durableBatch.status;
 
-        if (!fDirectory)
-        {
-            if (fBinary)
-            {
-                int startNumber = strtol(appendBuffer, NULL, 0);    // Convert start number to int base 10
-                AppendEvenNumbers(startNumber, appendPath);
-                if (status != E_OK)
-                    return status;
-            }
-            else
-            {
-                status = AppendText(appendBuffer, appendPath);
-                if (status != E_OK)
-                    return status;
-            }
-        }
-        else
-            fDirectory = DISABLE;
+    for (int i = 0; i < operationCount; i ++)
+    {
+        if (operationCount > 1)
+            ReportOperation(i, &operations[i]);
+        if (status == E_OK)
+            status = operations[i].status;
     }
+    return status != E_OK ? status : commitStatus;
+}
 
-    if (fDelete)
+//  function: OperationWorker
+//      Thread body for PerformOperations. Takes ready operations off the 
+//      queue, runs them and releases the operations that waited on them.
+//  @param: pointer to the shared OperationQueue
+//  @return: NULL
+void *
+OperationWorker(void *arg)
+{
+    struct OperationQueue *queue = arg;
+    pthread_mutex_lock(&queue->lock);
+    for (;;)
     {
-        status = CheckDirectory(deletePath);
-        if (status != E_OK)
-            return status;
+        while (queue->head == queue->tail && queue->finished < operationCount)
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        if (queue->head == queue->tail)
+            break;      // Everything has finished
+        int index = queue->ready[queue->head ++];
+        pthread_mutex_unlock(&queue->lock);
 
-        if (fDirectory)
-        {
-            status = RemoveDirectory(deletePath);
-            if (status != E_OK)
-                return status;
-            fDirectory = DISABLE;
-        }
-        else
+        operations[index].status = ExecuteOperation(&operations[index]);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->finished ++;
+        for (int j = index + 1; j < operationCount; j ++)
         {
-            status = RemoveFile(deletePath);
-            if (status != E_OK)
-                return status;
+            if (OperationsConflict(&operations[index], &operations[j]) && -- operations[j].blockers == 0)
+                queue->ready[queue->tail ++] = j;
         }
+        pthread_cond_broadcast(&queue->changed);
     }
-    return status;
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
 }
 
+//  function: ExecuteOperation
+//      Calls the appropriate functions for one operation
+//  @param: pointer to operation
+//  @return: Integer Error Code
+int
+ExecuteOperation(struct Operation *operation)
+{
+    int isDirectory = DISABLE;
+    int status = E_OK;
+    switch (operation->type)
+    {
+    case OP_CREATE:
+        if (createCount > 1)
+            return BulkCreate(operation->path, createCount, operation->directory);
+        if (operation->directory)
+            return CreateDirectory(operation->path);
+        return CreateFile(operation->path);
+    case OP_RENAME:
+        status = CheckDirectory(operation->path, &isDirectory);
+        if (status != E_OK)
+            return status;
+        if (isDirectory)
+            return RenameDirectory(operation->path, operation->newPath);
+        return RenameFile(operation->path, operation->newPath);
+    case OP_APPEND:
+    {
+        // Lists, globs and directories append to many files at once, unless a file has that very name
+        struct stat fileInfo;
+        if (operation->appendBuffer != NULL && IsFanOutSpec(operation->path) && 
+            !(stat(operation->path, &fileInfo) == E_OK && S_ISREG(fileInfo.st_mode)))
+            return FanOutAppend(operation->path, operation->appendBuffer, operation->binary);
+    }
+        status = CheckDirectory(operation->path, &isDirectory);
+        if (status != E_OK || operation->appendBuffer == NULL)
+            return status;
+        if (isDirectory)
+            return FanOutAppend(operation->path, operation->appendBuffer, operation->binary);
+        if (operation->binary)
+        {
+            int startNumber = strtol(operation->appendBuffer, NULL, 0);    // Convert start number to int base 10
+            return AppendEvenNumbers(startNumber, operation->path);
+        }
+        return AppendText(operation->appendBuffer, operation->path);
+    case OP_DELETE:
+        status = CheckDirectory(operation->path, &isDirectory);
+        if (status != E_OK)
+            return status;
+        if (isDirectory)
+            return RemoveDirectory(operation->path);
+        return RemoveFile(operation->path);
+    case OP_SYNC:
+        return SyncTrees(operation->path, operation->newPath);
+    case OP_GC:
+        return GarbageCollect(operation->path);
+    case OP_PACK:
+        return PackTree(operation->path, operation->newPath);
+    case OP_UNPACK:
+        return UnpackArchive(operation->path, operation->newPath);
+    case OP_SWAP:
+        return SwapDirectories(operation->path, operation->newPath, operation->reap);
+    case OP_TOP:
+        return StatsTop(operation->path);
+    case OP_META:
+        return UpdateMetadata(operation->path);
+    }
+    return E_GENERAL;
+}
+
+//  function: AddOperation
+//      Appends an operation to the list of operations to perform
+//  @param: Integer operation type
+//  @param: pointer to path to operate on
+//  @param: pointer to second path (rename target), may be NULL
+//  @return: index of the new operation, E_GENERAL if out of memory or if a
+//           relative path cannot be resolved
+int
+AddOperation(int type, char *path, char *newPath)
+{
+    static int capacity = 0;
+    static char *workingDirectory = NULL;
+    if (operationCount == capacity)
+    {
+        int newCapacity = capacity == 0 ? 16 : 2 * capacity;
+        struct Operation *grown = realloc(operations, newCapacity * sizeof(struct Operation));
+        if (grown == NULL)
+            return E_GENERAL;
+        operations = grown;
+        capacity = newCapacity;
+    }
+    if (workingDirectory == NULL)
+        workingDirectory = getcwd(NULL, 0);
+    struct Operation *operation = &operations[operationCount];
+    memset(operation, 0, sizeof(struct Operation));
+    operation->type = type;
+    operation->path = path;
+    operation->newPath = newPath;
+    operation->keys[0] = NormalizePath(path, workingDirectory);
+    operation->keys[1] = newPath ? NormalizePath(newPath, workingDirectory) : NULL;
+    if (operation->keys[0] == NULL || (newPath != NULL && operation->keys[1] == NULL))
+        return E_GENERAL;
+    return operationCount ++;
+}
+
+//  function: OperationsConflict
+//      Two operations conflict when any path of one is the same as, inside,
+//      or above any path of the other. A create with -n makes <path>.<n>, so
+//      it also conflicts with anything named <path>.something. An append to 
+//      a list or glob may touch any file, so it conflicts with everything.
+//  @param: pointers to the two operations
+//  @return: 1 if they conflict, 0 otherwise
+int
+OperationsConflict(struct Operation *first, struct Operation *second)
+{
+    if ((first->type == OP_APPEND && IsFanOutSpec(first->path)) || (second->type == OP_APPEND && IsFanOutSpec(second->path)))
+        return 1;
+    for (int i = 0; i < 2 && first->keys[i] != NULL; i ++)
+    {
+        for (int j = 0; j < 2 && second->keys[j] != NULL; j ++)
+        {
+            if (PathsOverlap(first->keys[i], second->keys[j]))
+                return 1;
+            if (first->type == OP_CREATE && createCount > 1 && IsNumberedPath(first->keys[i], second->keys[j]))
+                return 1;
+            if (second->type == OP_CREATE && createCount > 1 && IsNumberedPath(second->keys[j], first->keys[i]))
+                return 1;
+        }
+    }
+    return 0;
+}
+
+//  function: IsNumberedPath
+//      Checks if a normalized path is one of the <prefix>.<n> entries made by
+//      a create with -n, or lies inside one. Any suffix after the dot counts,
+//      to stay on the safe side.
+//  @param: pointer to the normalized prefix
+//  @param: pointer to the normalized path to check
+//  @return: 1 if it may be one of them, 0 otherwise
+int
+IsNumberedPath(char *prefix, char *path)
+{
+    size_t prefixLength = strlen(prefix);
+    return strncmp(prefix, path, prefixLength) == 0 && path[prefixLength] == '.';
+}
+
+//  function: PathsOverlap
+//      Checks if one normalized path is a prefix of the other on a component
+//      boundary, e.g. /a/b overlaps /a/b/c but not /a/bc
+//  @param: pointers to the two normalized paths
+//  @return: 1 if they overlap, 0 otherwise
+int
+PathsOverlap(char *first, char *second)
+{
+    size_t firstLength = strlen(first);
+    size_t secondLength = strlen(second);
+    if (firstLength > secondLength)
+        return PathsOverlap(second, first);
+    if (strncmp(first, second, firstLength) != 0)
+        return 0;
+    return second[firstLength] == '\0' || second[firstLength] == '/' || first[firstLength - 1] == '/';
+}
+
+//  function: NormalizePath
+//      Makes a path absolute and removes ".", ".." and repeated slashes without
+//      touching the filesystem, since the path may not exist yet. Symbolic 
+//      links are not resolved.
+//  @param: pointer to path
+//  @param: pointer to the working directory relative paths start from, NULL
+//          if it is not known
+//  @return: pointer to newly allocated normalized path, NULL if out of memory
+//           or if the path is relative and the working directory unknown
+char *
+NormalizePath(char *path, char *workingDirectory)
+{
+    struct PathBuilder pathBuilder;
+    if (path[0] != '/' && workingDirectory == NULL)
+        return NULL;    // Guessing "/" would make unrelated paths look alike
+    if (PathInit(&pathBuilder, path[0] == '/' ? "/" : workingDirectory) != E_OK)
+        return NULL;
+    char *component = path;
+    while (*component != '\0')
+    {
+        size_t length = strcspn(component, "/");
+        if (length == 2 && component[0] == '.' && component[1] == '.')
+        {
+            char *slash = strrchr(pathBuilder.path, '/');
+            PathPop(&pathBuilder, slash == pathBuilder.path ? 1 : (size_t) (slash - pathBuilder.path));
+        }
+        else if (length > 0 && !(length == 1 && component[0] == '.') && 
+                 PathPush(&pathBuilder, component, length) != E_OK)
+        {
+            PathFree(&pathBuilder);
+            return NULL;
+        }
+        component += length;
+        while (*component == '/')
+            component ++;
+    }
+    return pathBuilder.path;
+}
+
+//  function: ReportOperation
+//      Reports the result of one operation with PrintMessage, and in the log
+//      if enabled
+//  @param: Integer position of the operation on the command line
+//  @param: pointer to operation
+//  @return: Integer error code
+int
+ReportOperation(int index, struct Operation *operation)
+{
+    static char *names[] = {"create", "delete", "rename", "append", "sync", "gc", "pack", "unpack", "meta", "swap", "top"};
+    char number[24];
+    FormatLong(number, index + 1);
+    char *result = GetErrorMessage(operation->status);
+    if (fLog)
+        LogMessage("\nOperation ", number, " (", names[operation->type], " ", operation->path, "): ", result, NULL);
+    return PrintMessage("[", number, "] ", names[operation->type], " ", operation->path, ": ", result, "\n", NULL);
+}
 
 //  function: CheckDirectory
 //      This function checks if a given path is a file or directory and 
-//      sets the fDirectory flag appropriately
+//      sets the isDirectory flag appropriately
 //  @param: char pointer to the file path we want to check
+//  @param: pointer to flag, set to ENABLE for a directory
 //  @return: Integer error code
 int 
-CheckDirectory(char *filePath)
+CheckDirectory(char *filePath, int *isDirectory)
 {
     struct stat fileInfo;
     int status = stat(filePath, &fileInfo);
     if (status == E_GENERAL)
     {
+        status = errno;
         if (fLog)
-        {
-            char *errorMessage = GetErrorMessage(errno);
-            char buffer[BUF_SIZE] = "\nFailed to check directory: ";
-            status = CreateLog(strcat(buffer, errorMessage));
-            return status;
-        }
-        else return errno;
+            LogMessage("\nFailed to check directory: ", GetErrorMessage(status), NULL);
+        return status;
     }
     else 
     {
         if (fLog)
         {
-            char buffer[1024] = "\nChecked if path is file or directory: ";
-            char *message = strcat(buffer, filePath);
-            status = CreateLog(message);
+            status = LogMessage("\nChecked if path is file or directory: ", filePath, NULL);
             if (status != E_OK)
             {
                 return status;
@@ -337,7 +1428,7 @@ CheckDirectory(char *filePath)
         }
         if(S_ISDIR(fileInfo.st_mode))
         {
-            fDirectory = ENABLE;
+            *isDirectory = ENABLE;
             return E_OK;
         }
         else 
@@ -354,13 +1445,17 @@ CheckDirectory(char *filePath)
 //  @param: pointer to file path
 //  @param: buffer to use for writing/reading. Can be any data type.
 //  @param: number of bytes to write/read.
+//  @param: permissions for a created file, -1 if none is created
+//  @param: Integer ENABLE if the written data has to be made durable
 //  @return: integer error code
 int 
-NonBlockingOperation(ssize_t (*operation) (int, void *, size_t), int flag, char *filePath, void* buffer, int noOfBytes, int permissions) //will cause warning with write function as argument, but this is not an issue
+NonBlockingOperation(ssize_t (*operation) (int, void *, size_t), int flag, char *filePath, void* buffer, int noOfBytes, int permissions, int durable) //will cause warning with write function as argument, but this is not an issue
 {
     int fd;
     if (strcmp(filePath, "stdout") == 0)
         fd = STDOUT_FILENO;
+    else if (strcmp(filePath, "stderr") == 0)
+        fd = STDERR_FILENO;
     else
     {
         if (permissions == -1)
@@ -398,6 +1493,15 @@ NonBlockingOperation(ssize_t (*operation) (int, void *, size_t), int flag, char
         }
         if (fd <= STDERR_FILENO)
             return E_OK;
+        if (durable)
+        {
+            status = DurableFile(fd, filePath);
+            if (status != E_OK)
+            {
+                close(fd);
+                return status;
+            }
+        }
         status = close(fd);
         if (status == E_GENERAL)
             status = errno;
@@ -415,9 +1519,36 @@ int
 AppendEvenNumbers(int startNumber, char *filePath)
 {
     short int evenNumbers[25];
+    int bytesToWrite = EvenNumbersPayload(startNumber, evenNumbers);
+    if (bytesToWrite == 0)
+        return E_OK;
+    int status = NonBlockingOperation(&write, O_WRONLY | O_APPEND, filePath, evenNumbers, bytesToWrite, -1, ENABLE);
+    if (status == E_OK)
+    {
+        if (fLog)
+        {
+            status = LogMessage("\nAppended even numbers to ", filePath, NULL);
+        }
+        
+    }
+    else if (fLog)
+    {
+        LogMessage("\nCould not append even numbers: ", GetErrorMessage(status), NULL);
+    }   
+    return status;
+}
+
+//  function: EvenNumbersPayload
+//      Fills in the even numbers appended by -e, at most 50 bytes of them
+//  @param: Integer number to start from
+//  @param: pointer to room for 25 numbers
+//  @return: number of bytes to write, 0 if there is nothing to write
+int
+EvenNumbersPayload(int startNumber, short int *evenNumbers)
+{
     int bytesToWrite = 50;
     if (startNumber < 50) // To ensure at most 50 bytes get written
-        return E_OK;
+        return 0;
     else if (startNumber % 2 == 1)
         startNumber ++;
     for (int i = 0; i < 25; i ++)
@@ -430,24 +1561,7 @@ AppendEvenNumbers(int startNumber, char *filePath)
         evenNumbers[i] = startNumber;
         startNumber += 2;
     }
-    
-    int status = NonBlockingOperation(&write, O_WRONLY | O_APPEND, filePath, evenNumbers, bytesToWrite, -1);
-    if (status == E_OK)
-    {
-        if (fLog)
-        {
-            char buffer[BUF_SIZE] = "\nAppended even numbers to ";
-            status = CreateLog(strcat(buffer, filePath));
-        }
-        
-    }
-    else if (fLog)
-    {
-        char *errorMessage = GetErrorMessage(errno);
-        char buffer[BUF_SIZE] = "\nCould not append even numbers: ";
-        status = CreateLog(strcat(buffer, errorMessage));
-    }   
-    return status;
+    return bytesToWrite;
 }
 
 // function: ApppendOddNumbers
@@ -462,225 +1576,871 @@ AppendText(char *text, char* filePath) //Wrapper function
     int bytesToWrite = strlen(text);
     if (bytesToWrite > N_BYTES)
         bytesToWrite = N_BYTES; //To ensure at most 50 bytes are written
-    int status = NonBlockingOperation(&write, O_WRONLY | O_APPEND, filePath, text, bytesToWrite, -1);
+    int status = NonBlockingOperation(&write, O_WRONLY | O_APPEND, filePath, text, bytesToWrite, -1, ENABLE);
     if (status == E_OK)
     {
         if (fLog)
         {
-            char buffer[BUF_SIZE] = "\nAppended text to ";
-            status = CreateLog(strcat(buffer, filePath));
+            status = LogMessage("\nAppended text to ", filePath, NULL);
         }
     }
     else if (fLog)
     {
-        char *errorMessage = GetErrorMessage(errno);
-        char buffer[BUF_SIZE] = "\nCould not append text to ";
-        status = CreateLog(strcat(strcat(strcat(buffer, filePath), ": "), errorMessage));
+        LogMessage("\nCould not append text to ", filePath, ": ", GetErrorMessage(status), NULL);
     }   
     return status;
 }
 
-//  function: CreateFile
-//      Creates a file with specified file name
-//  @param: pointer to file path you want to create
-//  @return: Integer Error Code
-int 
-CreateFile(char *pathName)
+//  function: FanOutAppend
+//      Appends the same payload to many files. The targets are every regular
+//      file in a directory, the lines of an @listfile or the matches of a 
+//      glob. Each file is hashed by device and inode to one worker, so it is
+//      only ever written by one thread and its records stay in order. Every worker 
+//      keeps its own LRU pool of O_APPEND fds, and the records a file gets 
+//      within a window are written with a single writev.
+//  @param: pointer to target specification
+//  @param: pointer to text or start number given with -s / -e
+//  @param: Integer, append even numbers instead of text
+//  @return: Integer error code
+int
+FanOutAppend(char *targets, char *appendBuffer, int binary)
 {
-    int fd = creat(pathName, S_IRWXU); // User has read, write, and execute access, can be made input based in the future
-    int status = E_OK;
-    if (fd == E_GENERAL)
+    pthread_t threads[MAX_THREADS];
+    struct FanOutWorker workers[MAX_THREADS];
+    struct FanOutJob job;
+    short int evenNumbers[25];
+    struct ArenaMark mark = ArenaSave(&threadArena);
+    memset(&job, 0, sizeof(job));
+    if (binary)
     {
-        if (fLog)
-        {
-            char *errorMessage = GetErrorMessage(errno);
-            char buffer[BUF_SIZE] = "\nCould not create file ";
-            status = CreateLog(strcat(strcat(strcat(buffer, pathName), ": "), errorMessage));   
-            return status;
-        }
-        return errno;
+        job.payloadLength = EvenNumbersPayload(strtol(appendBuffer, NULL, 0), evenNumbers);
+        job.payload = (char *) evenNumbers;
     }
-    else 
+    else
     {
-        if (fLog)
+        job.payloadLength = strlen(appendBuffer);
+        if (job.payloadLength > N_BYTES)
+            job.payloadLength = N_BYTES;    // Same limit as a single append
+        job.payload = appendBuffer;
+    }
+    int status = FanOutCollect(&job, targets);
+    if (status == E_OK && job.count > 0 && job.payloadLength > 0)
+    {
+        struct rlimit limit;
+        job.threadCount = GetThreadCount(job.count);
+        job.poolSize = APPEND_POOL_SIZE;
+        // Leave half of the fd limit for everything else
+        if (getrlimit(RLIMIT_NOFILE, &limit) == E_OK && limit.rlim_cur / (2 * job.threadCount) < (rlim_t) job.poolSize)
+            job.poolSize = limit.rlim_cur / (2 * job.threadCount) > 0 ? limit.rlim_cur / (2 * job.threadCount) : 1;
+        StatsAdd(STAT_PLANNED, job.count);
+        int started = 0;
+        for (; started < job.threadCount; started ++)
         {
-            char buffer[BUF_SIZE] = "\nSuccessfully created file: ";
-            status = CreateLog(strcat(buffer, pathName));   
-            if (status != E_OK)
+            workers[started].job = &job;
+            workers[started].index = started;
+            if (pthread_create(&threads[started], NULL, FanOutWorker, &workers[started]) != E_OK)
+                break;
+        }
+        if (started < job.threadCount)
+        {
+            // Could not start them all, the missing workers' share is done here
+            for (int i = started; i < job.threadCount; i ++)
             {
-                int imStatus = close(fd);
-                if (imStatus == E_GENERAL)
-                    return errno;
-                return status;
+                workers[i].job = &job;
+                workers[i].index = i;
+                FanOutWorker(&workers[i]);
             }
         }
-        status = close(fd);
-        if (status == E_GENERAL)
-            return errno;
-        return status;
+        for (int i = 0; i < started; i ++)
+            pthread_join(threads[i], NULL);
+        status = job.status;
     }
-    
+    free(job.targets);
+    free(job.listBuffer);
+    ArenaRestore(&threadArena, mark);
+    if (fLog)
+    {
+        char numbers[2][24];
+        FormatLong(numbers[0], job.records);
+        FormatLong(numbers[1], job.files);
+        if (status != E_OK)
+        {
+            LogMessage("\nCould not append to all of ", targets, ": ", GetErrorMessage(status), NULL);
+            return status;
+        }
+        return LogMessage("\nAppended ", numbers[0], " records to ", numbers[1], " files of ", targets, NULL);
+    }
+    return status;
 }
 
-//  function: RenameFile
-//      Renames file using link and unlink
-//  @param: Pointer to old file name / path
-//  @param: Pointer to new file name / path
+//  function: FanOutCollect
+//      Expands a target specification into the list of files to append to. 
+//      "@file" reads one path per line, a directory gives its regular files,
+//      anything else is matched as a glob and gives the regular files among
+//      the matches. A path listed several times gets one record per listing.
+//  @param: pointer to the FanOutJob to fill
+//  @param: pointer to target specification
 //  @return: Integer error code
-int 
-RenameFile(char *oldFilePath, char *newFilePath)
+int
+FanOutCollect(struct FanOutJob *job, char *targets)
 {
     int status = E_OK;
-    if (link(oldFilePath, newFilePath) == E_GENERAL) // Done with link and unlink for learning purposes, can be done with rename system call
+    int isDirectory = DISABLE;
+    struct stat fileInfo;
+    if (targets[0] == '@')
     {
-        if (fLog)
+        // Read up to the end rather than st_size, the list may be a pipe or /dev/stdin
+        size_t length = 0, capacity = 0;
+        int fd = open(targets + 1, O_RDONLY);
+        if (fd == E_GENERAL)
+            return errno;
+        for (;;)
         {
-            char* errorMessage = GetErrorMessage(errno);
-            char buffer[BUF_SIZE] = "\nCould not rename the file ";
-            status = CreateLog(strcat(strcat(strcat(buffer, oldFilePath), ": "), errorMessage));
+            if (length + 1 >= capacity)
+            {
+                capacity = capacity == 0 ? DIRENT_BUF_SIZE : 2 * capacity;
+                char *grown = realloc(job->listBuffer, capacity);
+                if (grown == NULL)
+                {
+                    status = ENOMEM;
+                    break;
+                }
+                job->listBuffer = grown;
+            }
+            ssize_t nread = read(fd, job->listBuffer + length, capacity - length - 1);
+            if (nread == E_GENERAL && errno == EINTR)
+                continue;
+            if (nread == E_GENERAL)
+                status = errno;
+            if (nread <= 0)
+                break;
+            length += nread;
+        }
+        close(fd);
+        if (status != E_OK)
             return status;
+        job->listBuffer[length] = '\0';
+        for (char *line = job->listBuffer; *line != '\0' && status == E_OK; )
+        {
+            char *end = strchr(line, '\n');
+            if (end != NULL)
+                *end = '\0';
+            if (line[0] != '\0')
+                status = FanOutAddTarget(job, line, strlen(line), DISABLE, stat(line, &fileInfo) == E_OK ? &fileInfo : NULL);
+            if (end == NULL)
+                break;
+            line = end + 1;
         }
-        return errno;
-        
+        return status;
     }
-    else 
+    if (strpbrk(targets, "*?[") == NULL && CheckDirectory(targets, &isDirectory) == E_OK && isDirectory)
     {
-        if (unlink(oldFilePath) == E_GENERAL)
+        struct PathBuilder path;
+        char *buf = ArenaAlloc(&threadArena, DIRENT_BUF_SIZE);
+        int dirFd = open(targets, O_RDONLY | O_DIRECTORY);
+        if (dirFd == E_GENERAL || fstat(dirFd, &fileInfo) == E_GENERAL)
         {
-            if (fLog)
-            {
-                char* errorMessage = GetErrorMessage(errno);
-                char buffer[BUF_SIZE] = "\nCould not rename the file ";
-                status = CreateLog(strcat(strcat(strcat(buffer, oldFilePath), ": "), errorMessage));
-                return status;
-            }
-            return errno;   
+            status = errno;
+            if (dirFd != E_GENERAL)
+                close(dirFd);
+            return status;
         }
-        else if (fLog)
+        if (buf == NULL || PathInit(&path, targets) != E_OK)
         {
-            char buffer[BUF_SIZE] = "\nSuccessfully renamed ";
-            status = CreateLog(strcat(strcat(strcat(buffer, oldFilePath), " to "), newFilePath));
-            return status;
+            close(dirFd);
+            return ENOMEM;
         }
-        else return E_OK;
+        while (status == E_OK)
+        {
+            long nread = getdents64(dirFd, buf, DIRENT_BUF_SIZE);
+            if (nread == E_GENERAL)
+                status = errno;
+            if (nread <= 0)
+                break;
+            for (long bpos = 0; bpos < nread && status == E_OK; bpos += ((struct linux_dirent64 *) (buf + bpos))->d_reclen)
+            {
+                struct linux_dirent64 *d = (struct linux_dirent64 *) (buf + bpos);
+                unsigned char type = d->d_type;
+                if (type == DT_UNKNOWN)
+                {
+                    struct stat entryInfo;
+                    if (fstatat(dirFd, d->d_name, &entryInfo, AT_SYMLINK_NOFOLLOW) == E_OK)
+                        type = IFTODT(entryInfo.st_mode);
+                }
+                if (type != DT_REG)
+                    continue;       // Also skips "." and ".."
+                fileInfo.st_ino = d->d_ino;     // Same device as the directory
+                size_t dirLength = path.length;
+                status = PathPush(&path, d->d_name, strlen(d->d_name));
+                if (status == E_OK)
+                    status = FanOutAddTarget(job, path.path, path.length, ENABLE, &fileInfo);
+                PathPop(&path, dirLength);
+            }
+        }
+        PathFree(&path);
+        close(dirFd);
+        return status;
+    }
+    glob_t matches;
+    int globStatus = glob(targets, GLOB_NOSORT, NULL, &matches);
+    if (globStatus == GLOB_NOMATCH)
+        return ENOENT;
+    if (globStatus != E_OK)
+        return globStatus == GLOB_NOSPACE ? ENOMEM : EIO;
+    for (size_t i = 0; i < matches.gl_pathc && status == E_OK; i ++)
+    {
+        if (stat(matches.gl_pathv[i], &fileInfo) == E_OK && S_ISREG(fileInfo.st_mode))
+            status = FanOutAddTarget(job, matches.gl_pathv[i], strlen(matches.gl_pathv[i]), ENABLE, &fileInfo);
     }
+    globfree(&matches);
+    return status;
 }
 
-//  function: RenameDirectory
-//      Renames directory using rename system call
-//  @param: Pointer to old directory name / path
-//  @param: Pointer to new directory name / path
+//  function: FanOutAddTarget
+//      Adds a file to the target list together with the hash that decides 
+//      its worker
+//  @param: pointer to the FanOutJob
+//  @param: pointer to path
+//  @param: length of the path
+//  @param: Integer, copy the path into the arena because the caller reuses it
+//  @param: pointer to the stat of the file, NULL if it could not be looked up
 //  @return: Integer error code
-int 
-RenameDirectory(char *oldDirPath, char *newDirPath)
+int
+FanOutAddTarget(struct FanOutJob *job, char *path, size_t length, int copy, struct stat *fileInfo)
 {
-    if (rename(oldDirPath, newDirPath) == E_GENERAL)
+    if (job->count == job->capacity)
     {
-        if (fLog)
-        {
-            char *errorMessage = GetErrorMessage(errno);
-            char buffer[BUF_SIZE] = "\nCould not rename the directory ";
-            int status = CreateLog(strcat(strcat(strcat(buffer, oldDirPath), ": "), errorMessage));
-            return status;           
-        }
-        return errno;
+        long capacity = job->capacity == 0 ? 1024 : 2 * job->capacity;
+        struct FanOutTarget *grown = realloc(job->targets, capacity * sizeof(struct FanOutTarget));
+        if (grown == NULL)
+            return ENOMEM;
+        job->targets = grown;
+        job->capacity = capacity;
     }
-    else if (fLog)
+    if (copy)
     {
-        char buffer[BUF_SIZE] = "\nSuccessfully rename the directory: ";
-        int status = CreateLog(strcat(strcat(strcat(buffer, oldDirPath), " to "), newDirPath));
-        return status;
+        char *copied = ArenaAlloc(&threadArena, length + 1);
+        if (copied == NULL)
+            return ENOMEM;
+        memcpy(copied, path, length + 1);
+        path = copied;
     }
-    else return E_OK;
+    struct FanOutTarget *target = &job->targets[job->count ++];
+    target->path = path;
+    target->device = fileInfo != NULL ? fileInfo->st_dev : 0;
+    target->inode = fileInfo != NULL ? fileInfo->st_ino : 0;
+    // Missing files are told apart by path, opening them fails anyway
+    unsigned char *bytes = fileInfo != NULL ? (unsigned char *) &target->device : (unsigned char *) path;
+    size_t byteCount = fileInfo != NULL ? sizeof(target->device) : length;
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < byteCount; i ++)
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    for (size_t i = 0; fileInfo != NULL && i < sizeof(target->inode); i ++)
+        hash = (hash ^ ((unsigned char *) &target->inode)[i]) * FNV_PRIME;
+    target->hash = hash;
+    return E_OK;
 }
 
-//  function: CreateDirectory
-//      Creates a new directory
-//  @param: Pointer to pathname
-//  @return: Integer error code
-int 
-CreateDirectory(char *pathName)
+//  function: FanOutSameTarget
+//      Checks if two targets are the same file
+//  @param: pointers to the two targets
+//  @return: 1 if they are, 0 otherwise
+int
+FanOutSameTarget(struct FanOutTarget *first, struct FanOutTarget *second)
 {
-    int status = mkdir(pathName, S_IRWXU); // User has read, write, and execute access, can be made input based in the future
-    if (status == E_GENERAL)
+    if (first->hash != second->hash || first->device != second->device || first->inode != second->inode)
+        return 0;
+    return first->device != 0 || strcmp(first->path, second->path) == 0;
+}
+
+//  function: IsFanOutSpec
+//      Checks if an append target names a list file or a glob. A directory
+//      also fans out, but only the filesystem can tell.
+//  @param: pointer to the target as given on the command line
+//  @return: 1 if it does, 0 otherwise
+int
+IsFanOutSpec(char *path)
+{
+    return path[0] == '@' || strpbrk(path, "*?[") != NULL;
+}
+
+//  function: FanOutWorker
+//      Thread body for FanOutAppend. Goes through the targets hashed to this
+//      worker a window at a time. All records of one file in the window go 
+//      out in a single writev, through an fd from the worker's pool.
+//  @param: pointer to the FanOutWorker
+//  @return: NULL
+void *
+FanOutWorker(void *arg)
+{
+    struct FanOutWorker *worker = arg;
+    struct FanOutJob *job = worker->job;
+    struct AppendPoolEntry *pool = calloc(job->poolSize, sizeof(struct AppendPoolEntry));
+    long *window = malloc(APPEND_WINDOW * sizeof(long));
+    struct iovec *vectors = malloc(APPEND_WINDOW * sizeof(struct iovec));
+    long clock = 0, files = 0, records = 0;
+    if (pool == NULL || window == NULL || vectors == NULL)
     {
-        if (fLog)
-        {
-            char *errorMessage = GetErrorMessage(errno);
-            char buffer[BUF_SIZE] = "\nCould not create the directory ";
-            status = CreateLog(strcat(strcat(strcat(buffer, pathName), ": "), errorMessage));
-            return status;
-        }
-        return errno;
+        SetFirstError(&job->status, ENOMEM);
+        free(pool);
+        free(window);
+        free(vectors);
+        return NULL;
     }
-    else if (fLog)
+    for (int i = 0; i < job->poolSize; i ++)
+        pool[i].fd = E_GENERAL;
+    for (int i = 0; i < APPEND_WINDOW; i ++)
     {
-        char buffer[BUF_SIZE] = "\nSuccessfully created directory: ";
-        status = CreateLog(strcat(buffer, pathName));
+        vectors[i].iov_base = job->payload;
+        vectors[i].iov_len = job->payloadLength;
     }
-    return status;
-}   
-
-//  function: RemoveFile
-//      Deletes specified file if no other links exist, else unlinks
-//  @param: pointer to file path to delete / unlink
-//  @return: Integer error code
-int 
-RemoveFile(char *filePath)
-{
-    int status = unlink(filePath);
-    if (status == E_GENERAL)
+    for (long next = 0; next < job->count; )
     {
-        if (fLog)
+        int windowCount = 0;
+        for (; next < job->count && windowCount < APPEND_WINDOW; next ++)
         {
-            char *errorMessage = GetErrorMessage(errno);
-            char buffer[BUF_SIZE] = "\nCould not remove the file ";
-            status = CreateLog(strcat(strcat(strcat(buffer, filePath), ": "), errorMessage));    
-            return status;
+            if (job->targets[next].hash % job->threadCount == (uint64_t) worker->index)
+                window[windowCount ++] = next;
+        }
+        for (int i = 0; i < windowCount; i ++)
+        {
+            if (window[i] == E_GENERAL)
+                continue;
+            long target = window[i];
+            int recordCount = 1;
+            for (int j = i + 1; j < windowCount; j ++)
+            {
+                if (window[j] != E_GENERAL && FanOutSameTarget(&job->targets[window[j]], &job->targets[target]))
+                {
+                    window[j] = E_GENERAL;      // Same file, goes out with this write
+                    recordCount ++;
+                }
+            }
+            int status = FanOutWrite(job, pool, ++ clock, target, vectors, recordCount);
+            if (status != E_OK)
+            {
+                SetFirstError(&job->status, status);
+                if (fLog)
+                    LogMessage("\nCould not append text to ", job->targets[target].path, ": ", GetErrorMessage(status), NULL);
+                continue;
+            }
+            files ++;
+            records += recordCount;
+            StatsAdd(STAT_UPDATED, recordCount);
+            StatsAdd(STAT_BYTES_WRITTEN, recordCount * job->payloadLength);
         }
-        return errno;
     }
-    else if (fLog)
+    for (int i = 0; i < job->poolSize; i ++)
     {
-        char buffer[BUF_SIZE] = "\nSuccessfully removed file: ";
-        status = CreateLog(strcat(buffer, filePath));
+        if (pool[i].fd != E_GENERAL)
+            close(pool[i].fd);
     }
-    return status;
+    __atomic_fetch_add(&job->files, files, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&job->records, records, __ATOMIC_RELAXED);
+    free(pool);
+    free(window);
+    free(vectors);
+    return NULL;
 }
 
-//  function: RemoveDirectory
-//      Deletes specified directory
-//  @param: pointer to firectory path to delete
+//  function: FanOutWrite
+//      Writes a number of records to one target. The fd is taken from the 
+//      pool, or opened in place of the least recently used one.
+//  @param: pointer to the FanOutJob
+//  @param: pointer to the worker's fd pool
+//  @param: use counter of the worker, for the LRU order
+//  @param: index of the target
+//  @param: pointer to iovecs, each holding the payload
+//  @param: Integer number of records
 //  @return: Integer error code
 int
-RemoveDirectory(char *path)
+FanOutWrite(struct FanOutJob *job, struct AppendPoolEntry *pool, long clock, long target, struct iovec *vectors, int recordCount)
 {
-    int status = rmdir(path);
-    if (status == E_GENERAL)
+    struct AppendPoolEntry *entry = NULL, *oldest = &pool[0];
+    for (int i = 0; i < job->poolSize && entry == NULL; i ++)
     {
-        if (errno == ENOTEMPTY)
+        if (pool[i].fd != E_GENERAL && FanOutSameTarget(pool[i].target, &job->targets[target]))
+            entry = &pool[i];
+        else if (pool[i].lastUse < oldest->lastUse)
+            oldest = &pool[i];     // Unused slots have lastUse 0 and go first
+    }
+    if (entry == NULL)
+    {
+        entry = oldest;
+        if (entry->fd != E_GENERAL)
+            close(entry->fd);
+        entry->fd = open(job->targets[target].path, O_WRONLY | O_APPEND);
+        if (entry->fd == E_GENERAL)
         {
-            goto notEmpty;
+            entry->lastUse = 0;
+            return errno;
         }
-        else 
-        {
-            if (fLog)
-            {
-                char *errorMessage = GetErrorMessage(errno);
-                char buffer[BUF_SIZE] = "\nCould not remove the directory ";
-                status = CreateLog(strcat(strcat(strcat(buffer, path), ": "), errorMessage)); 
-                return status;
-            } 
-            return errno; 
+        entry->target = &job->targets[target];
+    }
+    entry->lastUse = clock;
+    size_t total = recordCount * job->payloadLength;
+    ssize_t written = writev(entry->fd, vectors, recordCount);
+    if (written == E_GENERAL)
+        return errno;
+    // A short write is finished piece by piece, so no record is left cut off
+    for (size_t done = written; done < total; done += written)
+    {
+        size_t offset = done % job->payloadLength;
+        written = write(entry->fd, job->payload + offset, job->payloadLength - offset);
+        if (written == E_GENERAL)
+            return errno;
+    }
+    return DurableFile(entry->fd, entry->target->path);
+}
+
+//  function: CreateFile
+//      Creates a file with specified file name using the mode given with -m.
+//      If a size was given with -z, the file is either preallocated with 
+//      fallocate (-p / -k) or extended sparsely with ftruncate.
+//  @param: pointer to file path you want to create
+//  @return: Integer Error Code
+int 
+CreateFile(char *pathName)
+{
+    int fd = open(pathName, O_WRONLY | O_CREAT | O_TRUNC, createMode); // Same as creat, mode is taken from the command line
+    int status = E_OK;
+    if (fd == E_GENERAL)
+    {
+        status = errno;
+        if (fLog)
+            LogMessage("\nCould not create file ", pathName, ": ", GetErrorMessage(status), NULL);   
+        return status;
+    }
+    else 
+    {
+        StatsAdd(STAT_CREATED, 1);
+        if (createSize > 0)
+            status = SizeFile(fd, pathName);
+        if (status == E_OK)
+            status = DurableFile(fd, pathName);
+        if (status == E_OK)
+            status = DurableParent(pathName, NULL);
+        if (status != E_OK)
+        {
+            if (close(fd) == E_GENERAL)
+                return errno;
+            return status;
+        }
+        if (fLog)
+        {
+            status = LogMessage("\nSuccessfully created file: ", pathName, NULL);   
+            if (status != E_OK)
+            {
+                int imStatus = close(fd);
+                if (imStatus == E_GENERAL)
+                    return errno;
+                return status;
+            }
         }
+        status = close(fd);
+        if (status == E_GENERAL)
+            return errno;
+        return status;
+    }
+    
+}
 
+//  function: SizeFile
+//      Gives a freshly created file its target size. With preallocation the
+//      blocks are reserved up front so the file gets contiguous extents,
+//      otherwise the file is only extended and stays sparse. Filesystems 
+//      without fallocate support fall back to a sparse file.
+//  @param: Integer file descriptor of the new file
+//  @param: pointer to file path, used for logging
+//  @return: Integer error code
+int
+SizeFile(int fd, char *pathName)
+{
+    int status = E_OK;
+    if (fPreallocate)
+    {
+        int mode = fKeepSize ? FALLOC_FL_KEEP_SIZE : 0;
+        status = fallocate(fd, mode, 0, createSize);
+        if (status == E_OK)
+            return E_OK;
+        if (errno != EOPNOTSUPP || fKeepSize)
+            goto sizeError;
+        if (fLog)
+        {
+            LogMessage("\nPreallocation not supported, creating sparse file: ", pathName, NULL);
+        }
     }
-    else
+    status = ftruncate(fd, createSize);
+    if (status == E_OK)
+        return E_OK;
+    sizeError:
+        status = errno;
+        if (fLog)
+        {
+            LogMessage("\nCould not size file ", pathName, ": ", GetErrorMessage(status), NULL);
+        }
+        return status;
+}
+
+//  function: BulkCreate
+//      Creates count files (or directories with -f) named <prefix>.0 to 
+//      <prefix>.<count - 1>, spreading the work over a pool of threads.
+//  @param: pointer to path prefix
+//  @param: number of entries to create
+//  @param: Integer flag, ENABLE to create directories
+//  @return: Integer error code of the first failure, E_OK otherwise
+int
+BulkCreate(char *prefix, long count, int directory)
+{
+    pthread_t threads[MAX_THREADS];
+    struct BulkCreateJob job = {prefix, count, 0, E_OK, directory};
+    int threadCount = GetThreadCount(count);
+    StatsAdd(STAT_PLANNED, count);
+    int started = 0;
+    for (; started < threadCount; started ++)
+    {
+        if (pthread_create(&threads[started], NULL, BulkCreateWorker, &job) != E_OK)
+            break;
+    }
+    if (started == 0)
+        BulkCreateWorker(&job);     // Could not start any thread, do the work ourselves
+    for (int i = 0; i < started; i ++)
+        pthread_join(threads[i], NULL);
+    if (fLog && job.status == E_OK)
+    {
+        return LogMessage("\nBulk creation finished for prefix: ", prefix, NULL);
+    }
+    return job.status;
+}
+
+//  function: BulkCreateWorker
+//      Thread body for BulkCreate. Keeps taking the next free index until
+//      all entries have been created.
+//  @param: pointer to the shared BulkCreateJob
+//  @return: NULL
+void *
+BulkCreateWorker(void *arg)
+{
+    struct BulkCreateJob *job = arg;
+    struct PathBuilder path;
+    char suffix[24] = ".";
+    if (PathInit(&path, job->prefix) != E_OK)
+    {
+        SetFirstError(&job->status, ENOMEM);
+        return NULL;
+    }
+    for (;;)
+    {
+        long index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (index >= job->count)
+            break;
+        int suffixLength = 1 + FormatLong(suffix + 1, index);
+        size_t prefixLength = path.length;
+        int status = PathAppend(&path, suffix, suffixLength);
+        if (status == E_OK)
+            status = job->directory ? CreateDirectory(path.path) : CreateFile(path.path);
+        PathPop(&path, prefixLength);
+        if (status != E_OK)
+            SetFirstError(&job->status, status);
+    }
+    PathFree(&path);
+    return NULL;
+}
+
+//  function: GetThreadCount
+//      Decides how many worker threads to use, either the -j value or one
+//      per online CPU, never more than there is work or MAX_THREADS.
+//  @param: number of work items
+//  @return: Integer thread count, at least 1
+int
+GetThreadCount(long workItems)
+{
+    long count = nThreads;
+    if (count == 0)
+        count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count > workItems)
+        count = workItems;
+    if (count > MAX_THREADS)
+        count = MAX_THREADS;
+    if (count < 1)
+        count = 1;
+    return count;
+}
+
+//  function: SetFirstError
+//      Stores an error code in a shared status unless an earlier error is 
+//      already there. Used by worker threads to report the first failure.
+//  @param: pointer to shared status
+//  @param: Integer error code
+//  @return: None
+void
+SetFirstError(int *status, int error)
+{
+    int expected = E_OK;
+    StatsAdd(STAT_ERRORS, 1);
+    __atomic_compare_exchange_n(status, &expected, error, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+//  function: ParseDuration
+//      Converts an age given on the command line to seconds. Accepts an 
+//      optional s, m, h or d suffix.
+//  @param: pointer to duration string
+//  @return: duration in seconds, E_GENERAL on malformed input
+long
+ParseDuration(char *durationString)
+{
+    char *end;
+    long duration = strtol(durationString, &end, 10);
+    if (end == durationString || duration < 0)
+        return E_GENERAL;
+    switch (*end)
+    {
+    case 'd':
+        duration *= 24;     // fall through
+    case 'h':
+        duration *= 60;     // fall through
+    case 'm':
+        duration *= 60;     // fall through
+    case 's':
+        end ++;
+        break;
+    case '\0':
+        break;
+    default:
+        return E_GENERAL;
+    }
+    if (*end != '\0')
+        return E_GENERAL;
+    return duration;
+}
+
+//  function: ParseOwner
+//      Splits an owner given as user[:group] into ids. Either part may be a 
+//      name or a number, and either may be left empty to keep it unchanged.
+//  @param: pointer to owner string
+//  @param: pointer to uid, set to -1 when not given
+//  @param: pointer to gid, set to -1 when not given
+//  @return: Integer error code
+int
+ParseOwner(char *ownerString, uid_t *uid, gid_t *gid)
+{
+    char user[BUF_SIZE];
+    char *colon = strchr(ownerString, ':');
+    size_t userLength = colon != NULL ? (size_t) (colon - ownerString) : strlen(ownerString);
+    char *group = colon != NULL ? colon + 1 : "";
+    char *end;
+    if (userLength >= BUF_SIZE)
+        return E_GENERAL;
+    memcpy(user, ownerString, userLength);
+    user[userLength] = '\0';
+    *uid = (uid_t) E_GENERAL;
+    *gid = (gid_t) E_GENERAL;
+    if (user[0] != '\0')
+    {
+        struct passwd *account = getpwnam(user);
+        if (account != NULL)
+            *uid = account->pw_uid;
+        else
+        {
+            *uid = strtoul(user, &end, 10);
+            if (*end != '\0')
+                return E_GENERAL;
+        }
+    }
+    if (group[0] != '\0')
+    {
+        struct group *entry = getgrnam(group);
+        if (entry != NULL)
+            *gid = entry->gr_gid;
+        else
+        {
+            *gid = strtoul(group, &end, 10);
+            if (*end != '\0')
+                return E_GENERAL;
+        }
+    }
+    return E_OK;
+}
+
+//  function: ParseSize
+//      Converts a size given on the command line to bytes. Accepts an 
+//      optional K, M, G or T suffix (powers of 1024).
+//  @param: pointer to size string
+//  @return: size in bytes, E_GENERAL on malformed input
+off_t
+ParseSize(char *sizeString)
+{
+    char *end;
+    int shift = 0;
+    errno = E_OK;
+    long long size = strtoll(sizeString, &end, 10);
+    if (end == sizeString || size < 0 || errno == ERANGE)
+        return E_GENERAL;
+    switch (*end)
+    {
+    case 'T': case 't':
+        shift += 10;    // fall through
+    case 'G': case 'g':
+        shift += 10;    // fall through
+    case 'M': case 'm':
+        shift += 10;    // fall through
+    case 'K': case 'k':
+        shift += 10;
+        end ++;
+        break;
+    case '\0':
+        break;
+    default:
+        return E_GENERAL;
+    }
+    if (*end != '\0' || size > (LLONG_MAX >> shift))
+        return E_GENERAL;   // Would not fit once the suffix is applied
+    return size << shift;
+}
+
+//  function: RenameFile
+//      Renames file using link and unlink
+//  @param: Pointer to old file name / path
+//  @param: Pointer to new file name / path
+//  @return: Integer error code
+int 
+RenameFile(char *oldFilePath, char *newFilePath)
+{
+    int status = E_OK;
+    if (link(oldFilePath, newFilePath) == E_GENERAL) // Done with link and unlink for learning purposes, can be done with rename system call
+    {
+        int error = errno;
+        if (fLog)
+            LogMessage("\nCould not rename the file ", oldFilePath, ": ", GetErrorMessage(error), NULL);
+        return error;
+    }
+    else 
+    {
+        if (unlink(oldFilePath) == E_GENERAL)
+        {
+            int error = errno;
+            if (fLog)
+                LogMessage("\nCould not rename the file ", oldFilePath, ": ", GetErrorMessage(error), NULL);
+            return error;
+        }
+        StatsAdd(STAT_UPDATED, 1);
+        status = DurableParent(newFilePath, oldFilePath);
+        if (status != E_OK)
+            return status;
+        if (fLog)
+        {
+            status = LogMessage("\nSuccessfully renamed ", oldFilePath, " to ", newFilePath, NULL);
+            return status;
+        }
+        else return E_OK;
+    }
+}
+
+//  function: RenameDirectory
+//      Renames directory using rename system call
+//  @param: Pointer to old directory name / path
+//  @param: Pointer to new directory name / path
+//  @return: Integer error code
+int 
+RenameDirectory(char *oldDirPath, char *newDirPath)
+{
+    if (rename(oldDirPath, newDirPath) == E_GENERAL)
+    {
+        int error = errno;
+        if (fLog)
+            LogMessage("\nCould not rename the directory ", oldDirPath, ": ", GetErrorMessage(error), NULL);
+        return error;
+    }
+    StatsAdd(STAT_UPDATED, 1);
+    int status = DurableParent(newDirPath, oldDirPath);
+    if (status != E_OK)
+        return status;
+    if (fLog)
+    {
+        status = LogMessage("\nSuccessfully rename the directory: ", oldDirPath, " to ", newDirPath, NULL);
+        return status;
+    }
+    else return E_OK;
+}
+
+//  function: CreateDirectory
+//      Creates a new directory
+//  @param: Pointer to pathname
+//  @return: Integer error code
+int 
+CreateDirectory(char *pathName)
+{
+    int status = mkdir(pathName, createMode); // Mode is taken from the command line, user has full access by default
+    if (status == E_GENERAL)
+    {
+        int error = errno;
+        if (fLog)
+            LogMessage("\nCould not create the directory ", pathName, ": ", GetErrorMessage(error), NULL);
+        return error;
+    }
+    StatsAdd(STAT_CREATED, 1);
+    status = DurableParent(pathName, NULL);
+    if (status == E_OK && fLog)
+    {
+        status = LogMessage("\nSuccessfully created directory: ", pathName, NULL);
+    }
+    return status;
+}   
+
+//  function: RemoveFile
+//      Deletes specified file if no other links exist, else unlinks
+//  @param: pointer to file path to delete / unlink
+//  @return: Integer error code
+int 
+RemoveFile(char *filePath)
+{
+    int status = unlink(filePath);
+    if (status == E_GENERAL)
     {
+        int error = errno;
         if (fLog)
+            LogMessage("\nCould not remove the file ", filePath, ": ", GetErrorMessage(error), NULL);
+        return error;
+    }
+    StatsAdd(STAT_DELETED, 1);
+    status = DurableParent(filePath, NULL);
+    if (status == E_OK && fLog)
+    {
+        status = LogMessage("\nSuccessfully removed file: ", filePath, NULL);
+    }
+    return status;
+}
+
+//  function: RemoveDirectory
+//      Deletes specified directory
+//  @param: pointer to firectory path to delete
+//  @return: Integer error code
+int
+RemoveDirectory(char *path)
+{
+    int status = rmdir(path);
+    if (status == E_GENERAL)
+    {
+        if (errno == ENOTEMPTY)
+        {
+            goto notEmpty;
+        }
+        else 
+        {
+            int error = errno;
+            if (fLog)
+                LogMessage("\nCould not remove the directory ", path, ": ", GetErrorMessage(error), NULL);
+            return error;
+        }
+
+    }
+    else
+    {
+        StatsAdd(STAT_DELETED, 1);
+        status = DurableParent(path, NULL);
+        if (status == E_OK && fLog)
         {
-            char buffer[BUF_SIZE] = "\nSuccessfully removed directory and its contents: ";
-            status = CreateLog(strcat(buffer, path));
+            status = LogMessage("\nSuccessfully removed directory and its contents: ", path, NULL);
         }
         return status;
     }
@@ -700,62 +2460,3931 @@ RemoveDirectory(char *path)
 int
 BulkDeleteDirectory(char *path)
 {
-    int fd;
-    long nread;
-    char buf[BUF_SIZE];
-    struct linux_dirent64 *d;
-    char d_type;
-    struct stat fileInfo;
-    char buffer[1024];
-    fd = open(path, O_RDONLY | O_DIRECTORY);
-    if (fd == -1)
+    struct PathBuilder pathBuilder;
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd == E_GENERAL)
         return errno;
+    if (PathInit(&pathBuilder, path) != E_OK)
+    {
+        close(fd);
+        return ENOMEM;
+    }
+    int status = BulkDeleteAt(fd, &pathBuilder);
+    PathFree(&pathBuilder);
+    if (close(fd) == E_GENERAL && status == E_OK)
+        status = errno;
+    return status;
+}
+
+//  function: BulkDeleteAt
+//      Deletes everything inside an open directory. All calls are relative to
+//      a directory fd, so there is no limit on path length and the kernel 
+//      does not resolve the full path again for every entry. The walk is 
+//      iterative and holds one fd and one dirent buffer however deep the tree
+//      is: going down, the parent is closed and only its read position is 
+//      kept; going up, ".." is opened and checked against the inode we came 
+//      from, and reading resumes at the saved position. The path builder 
+//      only tracks where we are for the log.
+//  @param: Integer fd of the directory to empty, left open for the caller
+//  @param: pointer to path builder holding the path of that directory
+//  @return: Integer error code
+int
+BulkDeleteAt(int dirFd, struct PathBuilder *pathBuilder)
+{
+    struct ArenaMark mark = ArenaSave(&threadArena);
+    char *buf = ArenaAlloc(&threadArena, DIRENT_BUF_SIZE);
+    struct DeleteFrame *frames = NULL;
+    long depth = 0, capacity = 0;
+    size_t rootLength = pathBuilder->length;
+    struct stat dirInfo;
+    int status = E_OK;
+    if (buf == NULL)
+        return ENOMEM;
+    int fd = fcntl(dirFd, F_DUPFD_CLOEXEC, 0);     // Ours to close when going down
+    if (fd == E_GENERAL || fstat(fd, &dirInfo) == E_GENERAL)
+    {
+        status = errno;
+        goto done;
+    }
     for (;;) 
     {
-        nread = getdents64(fd, buf, BUF_SIZE);
-        if (nread == -1)
-            return errno;
+        long nread = getdents64(fd, buf, DIRENT_BUF_SIZE);
+        if (nread == E_GENERAL)
+        {
+            status = errno;
+            goto done;
+        }
         if (nread == 0)
-            break;
-
-        for (long bpos = 0; bpos < nread;) {
-            d = (struct linux_dirent64 *) (buf + bpos);
-            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
-            {
-                goto skip;
-            }
-            strcpy(buffer, path);
-            strcat(buffer, "/");
-            strcat(buffer, d->d_name);
-            if (d->d_type == DT_DIR)
+        {
+            // This directory is empty now
+            status = DurableDirectory(fd, pathBuilder->path);   // One sync for all the unlinks in it
+            if (status != E_OK || depth == 0)
+                goto done;
+            struct DeleteFrame *frame = &frames[-- depth];
+            int parentFd = openat(fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (parentFd == E_GENERAL || fstat(parentFd, &dirInfo) == E_GENERAL)
+                status = errno;
+            else if (dirInfo.st_dev != frame->device || dirInfo.st_ino != frame->inode)
+                status = ESTALE;    // Moved while we were inside, do not delete in the wrong place
+            close(fd);
+            fd = parentFd;
+            if (status == E_OK && unlinkat(fd, pathBuilder->path + frame->nameOffset, AT_REMOVEDIR) == E_GENERAL)
+                status = errno;
+            if (status == E_OK)
             {
-                
-                int error = RemoveDirectory(buffer);  //Repeating the process for child directory
-                if(error != 0)
-                    return error;
-
+                StatsAdd(STAT_DELETED, 1);
+                if (fLog)
+                    LogMessage("\nSuccessfully removed directory and its contents: ", pathBuilder->path, NULL);
             }
             else
             {
-                int status = RemoveFile(buffer); // Deleting any file in the directory
-                if (status == E_GENERAL)
-                    return errno;
+                StatsAdd(STAT_ERRORS, 1);
+                if (fLog)
+                    LogMessage("\nCould not remove ", pathBuilder->path, ": ", GetErrorMessage(status), NULL);
+                goto done;
             }
-            skip:
-                bpos += d->d_reclen;
+            PathPop(pathBuilder, frame->pathLength);
+            if (lseek(fd, frame->offset, SEEK_SET) == E_GENERAL)
+                lseek(fd, 0, SEEK_SET);     // Start over, whatever was deleted is not read again
+            continue;
         }
-    }
-}
 
-//  function: CreateLog
-//      Logs specified message to a log file
-//  @param: pointer to message
-//  @return: Integer error code
-int
-CreateLog(char *message)
-{
-    int status = NonBlockingOperation(&write, O_APPEND | O_WRONLY | O_CREAT, logFileName, message, strlen(message), S_IRWXU);
-        return status;
+        for (long bpos = 0; bpos < nread; bpos += ((struct linux_dirent64 *) (buf + bpos))->d_reclen) 
+        {
+            struct linux_dirent64 *d = (struct linux_dirent64 *) (buf + bpos);
+            char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            StatsAdd(STAT_SCANNED, 1);
+            StatsAdd(STAT_PLANNED, 1);      // Everything found is going to be deleted
+            int isDirectory = d->d_type == DT_DIR;
+            if (d->d_type == DT_UNKNOWN)
+            {
+                struct stat fileInfo;
+                if (fstatat(fd, name, &fileInfo, AT_SYMLINK_NOFOLLOW) == E_GENERAL)
+                {
+                    status = errno;
+                    goto done;
+                }
+                isDirectory = S_ISDIR(fileInfo.st_mode);
+            }
+            size_t nameLength = strlen(name);
+            size_t parentLength = pathBuilder->length;
+            status = PathPush(pathBuilder, name, nameLength);
+            if (status != E_OK)
+                goto done;
+            if (isDirectory)
+            {
+                int childFd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (childFd == E_GENERAL)
+                    status = errno;
+                else if (depth == capacity)
+                {
+                    capacity = capacity == 0 ? 64 : 2 * capacity;
+                    struct DeleteFrame *grown = realloc(frames, capacity * sizeof(struct DeleteFrame));
+                    if (grown == NULL)
+                    {
+                        close(childFd);
+                        status = ENOMEM;
+                    }
+                    else
+                        frames = grown;
+                }
+                if (status == E_OK)
+                {
+                    // Go down, the parent is read on from the entry after this one when we come back
+                    struct DeleteFrame *frame = &frames[depth ++];
+                    frame->offset = d->d_off;
+                    frame->device = dirInfo.st_dev;
+                    frame->inode = dirInfo.st_ino;
+                    frame->pathLength = parentLength;
+                    frame->nameOffset = pathBuilder->length - nameLength;
+                    close(fd);
+                    fd = childFd;
+                    if (fstat(fd, &dirInfo) == E_GENERAL)
+                        status = errno;
+                    else
+                        break;
+                }
+            }
+            else
+            {
+                if (unlinkat(fd, name, 0) == E_GENERAL)   // Deleting any file in the directory
+                    status = errno;
+                else
+                {
+                    StatsAdd(STAT_DELETED, 1);
+                    if (fLog)
+                        LogMessage("\nSuccessfully removed file: ", pathBuilder->path, NULL);
+                }
+            }
+            if (status != E_OK)
+            {
+                StatsAdd(STAT_ERRORS, 1);
+                if (fLog)
+                    LogMessage("\nCould not remove ", pathBuilder->path, ": ", GetErrorMessage(status), NULL);
+                goto done;      // Stop at the first failure, the caller would otherwise retry forever
+            }
+            PathPop(pathBuilder, parentLength);
+        }
+    }
+    done:
+        if (fd != E_GENERAL)
+            close(fd);
+        free(frames);
+        PathPop(pathBuilder, rootLength);
+        ArenaRestore(&threadArena, mark);
+        return status;
+}
+
+//  function: WalkTree
+//      Walks a directory tree on a pool of threads. visit is called once for 
+//      every entry (except "." and ".."), from any worker. If it returns 
+//      WALK_DESCEND for a directory, that directory is walked too. leave is 
+//      called for every walked directory once it and all its descendants are
+//      done, while its own fd and the fd of its parent are still open.
+//  @param: pointer to root directory path
+//  @param: visitor function
+//  @param: leave function, may be NULL
+//  @param: pointer passed on to the callbacks as walker->context
+//  @param: Integer number of worker threads
+//  @return: Integer error code of the first failure, E_OK otherwise
+int
+WalkTree(char *root, WalkVisitor visit, WalkLeaver leave, void *context, int threadCount)
+{
+    pthread_t threads[MAX_THREADS];
+    struct Walker walker;
+    size_t rootLength = strlen(root);
+    struct WalkNode *node = malloc(sizeof(struct WalkNode) + rootLength + 1);
+    if (node == NULL)
+        return ENOMEM;
+    node->parent = NULL;
+    node->fd = E_GENERAL;
+    node->pending = 1;
+    node->modified = 0;
+    node->nameLength = rootLength;
+    memcpy(node->name, root, rootLength + 1);
+
+    walker.capacity = 64;
+    walker.stack = malloc(walker.capacity * sizeof(struct WalkNode *));
+    if (walker.stack == NULL)
+    {
+        free(node);
+        return ENOMEM;
+    }
+    walker.stack[0] = node;
+    walker.count = walker.outstanding = 1;
+    walker.visit = visit;
+    walker.leave = leave;
+    walker.context = context;
+    walker.status = E_OK;
+    pthread_mutex_init(&walker.lock, NULL);
+    pthread_cond_init(&walker.changed, NULL);
+
+    if (threadCount < 1)
+        threadCount = 1;
+    if (threadCount > MAX_THREADS)
+        threadCount = MAX_THREADS;
+    int started = 0;
+    for (; started < threadCount; started ++)
+    {
+        if (pthread_create(&threads[started], NULL, WalkWorker, &walker) != E_OK)
+            break;
+    }
+    if (started == 0)
+        WalkWorker(&walker);
+    for (int i = 0; i < started; i ++)
+        pthread_join(threads[i], NULL);
+    pthread_cond_destroy(&walker.changed);
+    pthread_mutex_destroy(&walker.lock);
+    free(walker.stack);
+    return walker.status;
+}
+
+//  function: WalkWorker
+//      Thread body for WalkTree. Pops a directory, opens it relative to its 
+//      parent, reads it with getdents64 and pushes the subdirectories the 
+//      visitor wants to enter.
+//  @param: pointer to the shared Walker
+//  @return: NULL
+void *
+WalkWorker(void *arg)
+{
+    struct Walker *walker = arg;
+    char *buf = malloc(DIRENT_BUF_SIZE);
+    if (buf == NULL)
+    {
+        SetFirstError(&walker->status, ENOMEM);
+        return NULL;    // The other workers will finish the walk
+    }
+    pthread_mutex_lock(&walker->lock);
+    for (;;)
+    {
+        while (walker->count == 0 && walker->outstanding > 0)
+            pthread_cond_wait(&walker->changed, &walker->lock);
+        if (walker->count == 0)
+            break;
+        struct WalkNode *node = walker->stack[-- walker->count];
+        pthread_mutex_unlock(&walker->lock);
+
+        if (node->parent == NULL)
+            node->fd = open(node->name, O_RDONLY | O_DIRECTORY);
+        else
+            node->fd = openat(node->parent->fd, node->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (node->fd == E_GENERAL)
+            SetFirstError(&walker->status, errno);
+        while (node->fd != E_GENERAL)
+        {
+            long nread = getdents64(node->fd, buf, DIRENT_BUF_SIZE);
+            if (nread == E_GENERAL)
+                SetFirstError(&walker->status, errno);
+            if (nread <= 0)
+                break;
+            for (long bpos = 0; bpos < nread; bpos += ((struct linux_dirent64 *) (buf + bpos))->d_reclen)
+            {
+                struct linux_dirent64 *d = (struct linux_dirent64 *) (buf + bpos);
+                char *name = d->d_name;
+                if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                    continue;
+                unsigned char type = d->d_type;
+                if (type == DT_UNKNOWN)
+                {
+                    struct stat fileInfo;
+                    if (fstatat(node->fd, name, &fileInfo, AT_SYMLINK_NOFOLLOW) == E_OK)
+                        type = IFTODT(fileInfo.st_mode);
+                }
+                if (walker->visit(walker, node, name, type) != WALK_DESCEND || type != DT_DIR)
+                    continue;
+                size_t nameLength = strlen(name);
+                struct WalkNode *child = malloc(sizeof(struct WalkNode) + nameLength + 1);
+                if (child == NULL)
+                {
+                    SetFirstError(&walker->status, ENOMEM);
+                    continue;
+                }
+                child->parent = node;
+                child->fd = E_GENERAL;
+                child->pending = 1;
+                child->modified = 0;
+                child->nameLength = nameLength;
+                memcpy(child->name, name, nameLength + 1);
+                __atomic_fetch_add(&node->pending, 1, __ATOMIC_RELAXED);
+
+                pthread_mutex_lock(&walker->lock);
+                if (walker->count == walker->capacity)
+                {
+                    struct WalkNode **grown = realloc(walker->stack, 2 * walker->capacity * sizeof(struct WalkNode *));
+                    if (grown == NULL)
+                    {
+                        pthread_mutex_unlock(&walker->lock);
+                        __atomic_fetch_sub(&node->pending, 1, __ATOMIC_RELAXED);
+                        free(child);
+                        SetFirstError(&walker->status, ENOMEM);
+                        continue;
+                    }
+                    walker->stack = grown;
+                    walker->capacity *= 2;
+                }
+                walker->stack[walker->count ++] = child;
+                walker->outstanding ++;
+                pthread_cond_signal(&walker->changed);
+                pthread_mutex_unlock(&walker->lock);
+            }
+        }
+        WalkRelease(walker, node);
+
+        pthread_mutex_lock(&walker->lock);
+        if (-- walker->outstanding == 0)
+            pthread_cond_broadcast(&walker->changed);
+    }
+    pthread_mutex_unlock(&walker->lock);
+    free(buf);
+    return NULL;
+}
+
+//  function: WalkRelease
+//      Drops one reference to a node. The last reference calls the leave 
+//      callback, closes the directory and releases the parent in turn.
+//  @param: pointer to the Walker
+//  @param: pointer to node
+//  @return: None
+void
+WalkRelease(struct Walker *walker, struct WalkNode *node)
+{
+    while (node != NULL && __atomic_sub_fetch(&node->pending, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        struct WalkNode *parent = node->parent;
+        if (walker->leave != NULL)
+            walker->leave(walker, node);
+        if (node->fd != E_GENERAL)
+            close(node->fd);
+        free(node);
+        node = parent;
+    }
+}
+
+//  function: WalkRelativePath
+//      Appends the path of a node relative to the walk root to a path builder
+//  @param: pointer to node
+//  @param: pointer to path builder
+//  @return: Integer error code
+int
+WalkRelativePath(struct WalkNode *node, struct PathBuilder *pathBuilder)
+{
+    if (node->parent == NULL)
+        return E_OK;
+    int status = WalkRelativePath(node->parent, pathBuilder);
+    if (status != E_OK)
+        return status;
+    return PathPush(pathBuilder, node->name, node->nameLength);
+}
+
+//  function: ComparePaths
+//      Orders paths like strcmp, except that '/' sorts before every other
+//      character. That keeps the entries of a directory right after it.
+//  @param: pointers to the two paths
+//  @return: negative, zero or positive like strcmp
+int
+ComparePaths(const char *first, const char *second)
+{
+    while (*first != '\0' && *first == *second)
+    {
+        first ++;
+        second ++;
+    }
+    int a = *first == '/' ? 1 : (unsigned char) *first;
+    int b = *second == '/' ? 1 : (unsigned char) *second;
+    return a - b;
+}
+
+//  function: SyncCompareEntries
+//      qsort comparator, orders sync entries by path
+static int
+SyncCompareEntries(const void *first, const void *second)
+{
+    return ComparePaths(((struct SyncEntry *) first)->path, ((struct SyncEntry *) second)->path);
+}
+
+//  function: SyncCompareKeys
+//      qsort / bsearch comparator for move detection, orders entry pointers by
+//      size and modification time
+static int
+SyncCompareKeys(const void *first, const void *second)
+{
+    struct SyncEntry *a = *(struct SyncEntry **) first;
+    struct SyncEntry *b = *(struct SyncEntry **) second;
+    if (a->size != b->size)
+        return a->size < b->size ? -1 : 1;
+    if (a->mtimeSeconds != b->mtimeSeconds)
+        return a->mtimeSeconds < b->mtimeSeconds ? -1 : 1;
+    if (a->mtimeNanoseconds != b->mtimeNanoseconds)
+        return a->mtimeNanoseconds < b->mtimeNanoseconds ? -1 : 1;
+    return 0;
+}
+
+//  function: SyncCompareInodes
+//      qsort / bsearch comparator for move detection, orders entry pointers by
+//      device and inode
+static int
+SyncCompareInodes(const void *first, const void *second)
+{
+    struct SyncEntry *a = *(struct SyncEntry **) first;
+    struct SyncEntry *b = *(struct SyncEntry **) second;
+    if (a->device != b->device)
+        return a->device < b->device ? -1 : 1;
+    if (a->inode != b->inode)
+        return a->inode < b->inode ? -1 : 1;
+    return 0;
+}
+
+//  function: SyncTrees
+//      Makes the target tree a mirror of the source tree with as few changes
+//      as possible. Both trees are scanned at the same time, then compared by
+//      size and modification time (and content with --checksum). Only the
+//      differences are applied: missing directories are created, moved files
+//      are renamed, new or changed files are copied (or just the new tail 
+//      appended when the old content is unchanged), leftovers are deleted and
+//      changed modes are set. Copied files get the source mtime, so the next 
+//      sync skips them.
+//  @param: pointer to source directory path
+//  @param: pointer to target directory path
+//  @return: Integer error code
+int
+SyncTrees(char *sourcePath, char *targetPath)
+{
+    struct SyncTree trees[2];
+    struct SyncPlan plan;
+    pthread_t scanner;
+    int threadCount = GetThreadCount(MAX_THREADS);
+    int status = E_OK;
+    memset(trees, 0, sizeof(trees));
+    memset(&plan, 0, sizeof(plan));
+    trees[0].root = sourcePath;
+    trees[1].root = targetPath;
+    for (int i = 0; i < 2; i ++)
+    {
+        pthread_mutex_init(&trees[i].lock, NULL);
+        trees[i].threads = threadCount > 1 ? threadCount / 2 : 1;
+        trees[i].fd = E_GENERAL;
+    }
+
+    if (access(targetPath, F_OK) == E_GENERAL && errno == ENOENT)
+    {
+        status = CreateDirectory(targetPath);   // First sync into a new target
+        if (status != E_OK)
+            goto cleanup;
+    }
+    for (int i = 0; i < 2; i ++)
+    {
+        trees[i].fd = open(trees[i].root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (trees[i].fd == E_GENERAL)
+        {
+            status = errno;
+            if (fLog)
+                LogMessage("\nCould not open ", trees[i].root, ": ", GetErrorMessage(status), NULL);
+            goto cleanup;
+        }
+    }
+    // Scan both trees in parallel, the target on a second thread
+    int scannerStarted = pthread_create(&scanner, NULL, SyncScanTree, &trees[1]) == E_OK;
+    if (!scannerStarted)
+        SyncScanTree(&trees[1]);
+    SyncScanTree(&trees[0]);
+    if (scannerStarted)
+        pthread_join(scanner, NULL);
+    status = trees[0].status != E_OK ? trees[0].status : trees[1].status;
+    if (status != E_OK)
+    {
+        if (fLog)
+            LogMessage("\nCould not scan trees for sync of ", sourcePath, ": ", GetErrorMessage(status), NULL);
+        goto cleanup;
+    }
+    qsort(trees[0].entries, trees[0].count, sizeof(struct SyncEntry), SyncCompareEntries);
+    qsort(trees[1].entries, trees[1].count, sizeof(struct SyncEntry), SyncCompareEntries);
+
+    status = SyncPlan(&trees[0], &trees[1], &plan);
+    for (int type = 0; type < SYNC_PHASES && status == E_OK; type ++)
+        status = SyncRunPhase(&trees[0], &trees[1], plan.actions[type], plan.count[type], type);
+
+    if (status == E_OK && fLog)
+    {
+        char counts[SYNC_PHASES][24];
+        for (int type = 0; type < SYNC_PHASES; type ++)
+            FormatLong(counts[type], plan.count[type]);
+        status = LogMessage("\nSynced ", sourcePath, " to ", targetPath, ": ", counts[SYNC_MKDIR], " directories created, ",
+                            counts[SYNC_RENAME], " renamed, ", counts[SYNC_COPY], " copied, ", counts[SYNC_APPEND], " appended, ",
+                            counts[SYNC_DELETE], " deleted, ", counts[SYNC_CHMOD], " modes changed", NULL);
+    }
+    cleanup:
+        for (int i = 0; i < 2; i ++)
+        {
+            free(trees[i].entries);
+            ArenaRestore(&trees[i].arena, (struct ArenaMark) {NULL, 0});
+            pthread_mutex_destroy(&trees[i].lock);
+            if (trees[i].fd != E_GENERAL)
+                close(trees[i].fd);
+        }
+        for (int type = 0; type <= SYNC_CHECK; type ++)
+            free(plan.actions[type]);
+        return status;
+}
+
+//  function: SyncScanTree
+//      Collects the entries of one tree for SyncTrees. Runs as a thread body.
+//  @param: pointer to the SyncTree to fill
+//  @return: NULL
+void *
+SyncScanTree(void *arg)
+{
+    struct SyncTree *tree = arg;
+    int status = WalkTree(tree->root, SyncVisit, NULL, tree, tree->threads);
+    if (status != E_OK)
+        SetFirstError(&tree->status, status);
+    return NULL;
+}
+
+//  function: SyncVisit
+//      Walk visitor for SyncScanTree. Reads the metadata of every entry and
+//      records it. SyncPlan ignores source entries that are not regular files
+//      or directories, but deletes or replaces such entries in the target.
+//  @param: pointer to the Walker
+//  @param: pointer to the directory node
+//  @param: pointer to the entry name
+//  @param: d_type of the entry
+//  @return: WALK_DESCEND for directories, WALK_CONTINUE otherwise
+int
+SyncVisit(struct Walker *walker, struct WalkNode *directory, char *name, unsigned char type)
+{
+    struct SyncTree *tree = walker->context;
+    struct statx fileInfo;
+    StatsAdd(STAT_SCANNED, 1);
+    if (statx(directory->fd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_INO, &fileInfo) == E_GENERAL)
+    {
+        SetFirstError(&walker->status, errno);
+        return WALK_CONTINUE;
+    }
+    struct PathBuilder path;
+    if (PathInit(&path, "") != E_OK)
+    {
+        SetFirstError(&walker->status, ENOMEM);
+        return WALK_CONTINUE;
+    }
+    int status = WalkRelativePath(directory, &path);
+    if (status == E_OK)
+        status = PathPush(&path, name, strlen(name));
+    if (status == E_OK)
+        status = SyncAddEntry(tree, path.path, &fileInfo);
+    PathFree(&path);
+    if (status != E_OK)
+        SetFirstError(&walker->status, status);
+    return type == DT_DIR ? WALK_DESCEND : WALK_CONTINUE;
+}
+
+//  function: SyncAddEntry
+//      Records one entry of a tree, safe to call from several walk workers
+//  @param: pointer to the SyncTree
+//  @param: pointer to the relative path
+//  @param: pointer to its metadata
+//  @return: Integer error code
+int
+SyncAddEntry(struct SyncTree *tree, char *path, struct statx *fileInfo)
+{
+    size_t length = strlen(path);
+    pthread_mutex_lock(&tree->lock);
+    if (tree->count == tree->capacity)
+    {
+        long capacity = tree->capacity == 0 ? 1024 : 2 * tree->capacity;
+        struct SyncEntry *grown = realloc(tree->entries, capacity * sizeof(struct SyncEntry));
+        if (grown == NULL)
+        {
+            pthread_mutex_unlock(&tree->lock);
+            return ENOMEM;
+        }
+        tree->entries = grown;
+        tree->capacity = capacity;
+    }
+    char *copy = ArenaAlloc(&tree->arena, length + 1);
+    if (copy == NULL)
+    {
+        pthread_mutex_unlock(&tree->lock);
+        return ENOMEM;
+    }
+    memcpy(copy, path, length + 1);
+    struct SyncEntry *entry = &tree->entries[tree->count ++];
+    memset(entry, 0, sizeof(struct SyncEntry));
+    entry->path = copy;
+    entry->size = fileInfo->stx_size;
+    entry->mtimeSeconds = fileInfo->stx_mtime.tv_sec;
+    entry->mtimeNanoseconds = fileInfo->stx_mtime.tv_nsec;
+    entry->device = makedev(fileInfo->stx_dev_major, fileInfo->stx_dev_minor);
+    entry->inode = fileInfo->stx_ino;
+    entry->mode = fileInfo->stx_mode;
+    pthread_mutex_unlock(&tree->lock);
+    return E_OK;
+}
+
+//  function: SyncPlan
+//      Compares two sorted trees and lists the actions that make the target
+//      equal to the source. Entries below a target directory that is going to
+//      be deleted are not deleted one by one, but may still be moved out first.
+//      With --checksum the content comparisons are collected first and run on
+//      a pool of threads before they are turned into actions.
+//  @param: pointer to the source tree
+//  @param: pointer to the target tree
+//  @param: pointer to the plan to fill
+//  @return: Integer error code
+int
+SyncPlan(struct SyncTree *source, struct SyncTree *target, struct SyncPlan *plan)
+{
+    struct SyncEntry **newFiles = malloc((source->count + 1) * sizeof(struct SyncEntry *));
+    long newFileCount = 0;
+    char *deletedDirectory = NULL;      // Target directory being deleted as a whole
+    size_t deletedLength = 0;
+    int status = E_OK;
+    long i = 0, j = 0;
+    if (newFiles == NULL)
+        return ENOMEM;
+    while ((i < source->count || j < target->count) && status == E_OK)
+    {
+        struct SyncEntry *from = i < source->count ? &source->entries[i] : NULL;
+        struct SyncEntry *to = j < target->count ? &target->entries[j] : NULL;
+        if (from != NULL && !S_ISDIR(from->mode) && !S_ISREG(from->mode))
+        {
+            i ++;       // Only regular files and directories are synced
+            continue;
+        }
+        int order = from == NULL ? 1 : to == NULL ? -1 : ComparePaths(from->path, to->path);
+        if (to != NULL && deletedDirectory != NULL && 
+            strncmp(to->path, deletedDirectory, deletedLength) == 0 && to->path[deletedLength] == '/')
+        {
+            j ++;       // Goes away with its directory, unless the move detection picks it up
+            continue;
+        }
+        if (order < 0)
+        {
+            if (S_ISDIR(from->mode))
+                status = SyncAddAction(plan, SYNC_MKDIR, from, NULL);
+            else
+                newFiles[newFileCount ++] = from;
+            i ++;
+        }
+        else if (order > 0)
+        {
+            status = SyncAddAction(plan, SYNC_DELETE, NULL, to);
+            if (S_ISDIR(to->mode))
+            {
+                deletedDirectory = to->path;
+                deletedLength = strlen(to->path);
+            }
+            j ++;
+        }
+        else
+        {
+            if ((from->mode & S_IFMT) != (to->mode & S_IFMT))
+            {
+                // Type changed, the old entry has to go before the new one is made.
+                // Nothing below it may be moved, it is deleted before the renames.
+                status = SyncAddAction(plan, SYNC_MKDIR, NULL, to);
+                if (status == E_OK && S_ISDIR(from->mode))
+                    status = SyncAddAction(plan, SYNC_MKDIR, from, NULL);
+                else if (status == E_OK)
+                    newFiles[newFileCount ++] = from;
+                to->matched = ENABLE;
+                if (S_ISDIR(to->mode))
+                {
+                    deletedDirectory = to->path;
+                    deletedLength = strlen(to->path);
+                    for (long k = j + 1; k < target->count && strncmp(target->entries[k].path, to->path, deletedLength) == 0 && 
+                         target->entries[k].path[deletedLength] == '/'; k ++)
+                        target->entries[k].matched = ENABLE;     // Not available for moves
+                }
+            }
+            else if (S_ISREG(from->mode))
+            {
+                int same = from->size == to->size && from->mtimeSeconds == to->mtimeSeconds && 
+                           from->mtimeNanoseconds == to->mtimeNanoseconds;
+                if (fChecksum && (same || (to->size > 0 && to->size < from->size)))
+                {
+                    // Compare the whole file, or the old part if it only grew
+                    status = SyncAddAction(plan, SYNC_CHECK, from, to);
+                    if (status == E_OK)
+                        plan->actions[SYNC_CHECK][plan->count[SYNC_CHECK] - 1].length = same ? from->size : to->size;
+                }
+                else if (!same)
+                    status = SyncAddAction(plan, SYNC_COPY, from, to);
+                else if ((from->mode & 07777) != (to->mode & 07777))
+                    status = SyncAddAction(plan, SYNC_CHMOD, from, to);
+            }
+            else if ((from->mode & 07777) != (to->mode & 07777))
+                status = SyncAddAction(plan, SYNC_CHMOD, from, to);
+            to->matched = ENABLE;
+            i ++;
+            j ++;
+        }
+    }
+    if (status == E_OK && plan->count[SYNC_CHECK] > 0)
+        status = SyncRunPhase(source, target, plan->actions[SYNC_CHECK], plan->count[SYNC_CHECK], SYNC_CHECK);
+    for (long k = 0; k < plan->count[SYNC_CHECK] && status == E_OK; k ++)
+    {
+        struct SyncAction *check = &plan->actions[SYNC_CHECK][k];
+        if (!check->same)
+            status = SyncAddAction(plan, SYNC_COPY, check->source, check->target);
+        else if (check->length < check->source->size)
+            status = SyncAddAction(plan, SYNC_APPEND, check->source, check->target);
+        else if ((check->source->mode & 07777) != (check->target->mode & 07777))
+            status = SyncAddAction(plan, SYNC_CHMOD, check->source, check->target);
+    }
+    plan->count[SYNC_CHECK] = 0;
+    if (status == E_OK)
+        status = SyncMatchMoves(source, target, plan, newFiles, newFileCount);
+    free(newFiles);
+    return status;
+}
+
+//  function: SyncMatchMoves
+//      Looks for files that only exist in the source among the files that 
+//      only exist in the target. A target file with the same inode (hard 
+//      linked trees) is renamed into place instead of copied. So is one with
+//      the same size, mtime and content hash, the files that could match are
+//      hashed on a pool of threads first.
+//  @param: pointer to the source tree
+//  @param: pointer to the target tree
+//  @param: pointer to the plan to add renames and copies to
+//  @param: pointer to array of new source files
+//  @param: number of new source files
+//  @return: Integer error code
+int
+SyncMatchMoves(struct SyncTree *source, struct SyncTree *target, struct SyncPlan *plan, struct SyncEntry **newFiles, long newFileCount)
+{
+    struct SyncEntry **byKey = malloc((target->count + 1) * sizeof(struct SyncEntry *));
+    struct SyncEntry **byInode = malloc((target->count + 1) * sizeof(struct SyncEntry *));
+    long candidateCount = 0;
+    int status = E_OK;
+    if (byKey != NULL && byInode != NULL)
+    {
+        for (long j = 0; j < target->count; j ++)
+        {
+            struct SyncEntry *entry = &target->entries[j];
+            if (!entry->matched && S_ISREG(entry->mode))
+                byKey[candidateCount] = byInode[candidateCount] = entry, candidateCount ++;
+        }
+        qsort(byKey, candidateCount, sizeof(struct SyncEntry *), SyncCompareKeys);
+        qsort(byInode, candidateCount, sizeof(struct SyncEntry *), SyncCompareInodes);
+    }
+    // Queue every file that may take part in a match by size and mtime for hashing
+    for (long i = 0; i < newFileCount && candidateCount > 0 && status == E_OK; i ++)
+    {
+        struct SyncEntry *from = newFiles[i];
+        struct SyncEntry **found = bsearch(&from, byKey, candidateCount, sizeof(struct SyncEntry *), SyncCompareKeys);
+        if (found == NULL)
+            continue;
+        while (found > byKey && SyncCompareKeys(found - 1, &from) == 0)
+            found --;       // bsearch may land anywhere in a run of equal keys
+        from->queued = ENABLE;
+        status = SyncAddAction(plan, SYNC_CHECK, from, NULL);
+        for (; found < byKey + candidateCount && SyncCompareKeys(found, &from) == 0 && status == E_OK; found ++)
+        {
+            if (!(*found)->queued)
+            {
+                (*found)->queued = ENABLE;
+                status = SyncAddAction(plan, SYNC_CHECK, NULL, *found);
+            }
+        }
+    }
+    if (status == E_OK && plan->count[SYNC_CHECK] > 0)
+        status = SyncRunPhase(source, target, plan->actions[SYNC_CHECK], plan->count[SYNC_CHECK], SYNC_CHECK);
+    plan->count[SYNC_CHECK] = 0;
+    for (long i = 0; i < newFileCount && status == E_OK; i ++)
+    {
+        struct SyncEntry *from = newFiles[i];
+        struct SyncEntry *move = NULL;
+        if (candidateCount > 0)
+        {
+            struct SyncEntry **found = bsearch(&from, byInode, candidateCount, sizeof(struct SyncEntry *), SyncCompareInodes);
+            if (found != NULL && !(*found)->matched)
+                move = *found;
+            found = move || !from->queued ? NULL : bsearch(&from, byKey, candidateCount, sizeof(struct SyncEntry *), SyncCompareKeys);
+            if (found != NULL)
+            {
+                while (found > byKey && SyncCompareKeys(found - 1, &from) == 0)
+                    found --;
+                for (; found < byKey + candidateCount && SyncCompareKeys(found, &from) == 0 && move == NULL; found ++)
+                {
+                    // The hashes are cached by now, unless reading the file failed
+                    if (!(*found)->matched && SyncSameContent(source, from, target, *found, from->size))
+                        move = *found;
+                }
+            }
+        }
+        if (move != NULL)
+        {
+            move->matched = ENABLE;
+            status = SyncAddAction(plan, SYNC_RENAME, from, move);
+            if (status == E_OK && (from->mode & 07777) != (move->mode & 07777))
+                status = SyncAddAction(plan, SYNC_CHMOD, from, move);
+        }
+        else
+            status = SyncAddAction(plan, SYNC_COPY, from, NULL);
+    }
+    // Whatever was moved must not be deleted on its own afterwards
+    long kept = 0;
+    for (long k = 0; k < plan->count[SYNC_DELETE]; k ++)
+    {
+        struct SyncAction *action = &plan->actions[SYNC_DELETE][k];
+        if (!(S_ISREG(action->target->mode) && action->target->matched))
+            plan->actions[SYNC_DELETE][kept ++] = *action;
+    }
+    plan->count[SYNC_DELETE] = kept;
+    free(byKey);
+    free(byInode);
+    return status;
+}
+
+//  function: SyncAddAction
+//      Adds one action to the plan
+//  @param: pointer to plan
+//  @param: Integer action type (SYNC_MKDIR, SYNC_RENAME, ...)
+//  @param: pointer to source entry, may be NULL
+//  @param: pointer to target entry, may be NULL
+//  @return: Integer error code
+int
+SyncAddAction(struct SyncPlan *plan, int type, struct SyncEntry *source, struct SyncEntry *target)
+{
+    if (plan->count[type] == plan->capacity[type])
+    {
+        long capacity = plan->capacity[type] == 0 ? 64 : 2 * plan->capacity[type];
+        struct SyncAction *grown = realloc(plan->actions[type], capacity * sizeof(struct SyncAction));
+        if (grown == NULL)
+            return ENOMEM;
+        plan->actions[type] = grown;
+        plan->capacity[type] = capacity;
+    }
+    plan->actions[type][plan->count[type] ++] = (struct SyncAction) {source, target, 0, 0};
+    return E_OK;
+}
+
+//  function: SyncSameContent
+//      Compares the content hash of the first length bytes of two files
+//  @param: pointers to the tree and entry of the first file
+//  @param: pointers to the tree and entry of the second file
+//  @param: number of bytes to compare, the full size of at least one file
+//  @return: 1 if the content is the same, 0 otherwise or on error
+int
+SyncSameContent(struct SyncTree *firstTree, struct SyncEntry *first, struct SyncTree *secondTree, struct SyncEntry *second, off_t length)
+{
+    uint64_t firstHash, secondHash;
+    if (SyncHash(firstTree, first, length, &firstHash) != E_OK || SyncHash(secondTree, second, length, &secondHash) != E_OK)
+        return 0;
+    return firstHash == secondHash;
+}
+
+//  function: SyncHash
+//      Computes the 64-bit FNV-1a hash of the first length bytes of a file.
+//      The hash of the whole file is cached in the entry.
+//  @param: pointer to the tree the entry belongs to
+//  @param: pointer to entry
+//  @param: number of bytes to hash
+//  @param: pointer to where the hash is stored
+//  @return: Integer error code
+int
+SyncHash(struct SyncTree *tree, struct SyncEntry *entry, off_t length, uint64_t *hash)
+{
+    if (entry->hashed && length == entry->size)
+    {
+        *hash = entry->hash;
+        return E_OK;
+    }
+    char *base;
+    int dirFd = OpenParentBeneath(tree->fd, entry->path, DISABLE, O_PATH, &base);
+    int fd = dirFd == E_GENERAL ? E_GENERAL : openat(dirFd, base, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    int status = fd == E_GENERAL ? errno : E_OK;
+    if (dirFd != E_GENERAL && dirFd != tree->fd)
+        close(dirFd);
+    if (fd == E_GENERAL)
+        return status;
+    posix_fadvise(fd, 0, length, POSIX_FADV_SEQUENTIAL);
+    struct ArenaMark mark = ArenaSave(&threadArena);
+    unsigned char *buffer = ArenaAlloc(&threadArena, HASH_BUF_SIZE);
+    uint64_t value = FNV_OFFSET_BASIS;
+    off_t remaining = length;
+    status = buffer == NULL ? ENOMEM : E_OK;
+    while (remaining > 0 && status == E_OK)
+    {
+        ssize_t nread = read(fd, buffer, remaining < HASH_BUF_SIZE ? remaining : HASH_BUF_SIZE);
+        if (nread <= 0)
+        {
+            status = nread == 0 ? EIO : errno;      // File shrank while we were reading it
+            break;
+        }
+        for (ssize_t k = 0; k < nread; k ++)
+            value = (value ^ buffer[k]) * FNV_PRIME;
+        remaining -= nread;
+    }
+    ArenaRestore(&threadArena, mark);
+    close(fd);
+    if (status != E_OK)
+        return status;
+    if (length == entry->size)
+    {
+        entry->hash = value;
+        entry->hashed = ENABLE;
+    }
+    *hash = value;
+    return E_OK;
+}
+
+//  function: SyncRunPhase
+//      Executes all actions of one type. Directories are created one after
+//      the other so parents exist before their children, everything else is
+//      spread over a pool of threads.
+//  @param: pointer to the source tree
+//  @param: pointer to the target tree
+//  @param: pointer to the actions
+//  @param: number of actions
+//  @param: Integer action type
+//  @return: Integer error code of the first failure, E_OK otherwise
+int
+SyncRunPhase(struct SyncTree *source, struct SyncTree *target, struct SyncAction *actions, long count, int type)
+{
+    pthread_t threads[MAX_THREADS];
+    struct SyncPhaseJob job = {source, target, actions, count, 0, type, E_OK};
+    if (count == 0)
+        return E_OK;
+    if (type != SYNC_CHECK)
+        StatsAdd(STAT_PLANNED, count);
+    int threadCount = type == SYNC_MKDIR ? 1 : GetThreadCount(count);
+    int started = 0;
+    for (; threadCount > 1 && started < threadCount; started ++)
+    {
+        if (pthread_create(&threads[started], NULL, SyncActionWorker, &job) != E_OK)
+            break;
+    }
+    if (started == 0)
+        SyncActionWorker(&job);
+    for (int i = 0; i < started; i ++)
+        pthread_join(threads[i], NULL);
+    return job.status;
+}
+
+//  function: SyncActionWorker
+//      Thread body for SyncRunPhase. Keeps taking the next action until all
+//      actions of the phase are done.
+//  @param: pointer to the shared SyncPhaseJob
+//  @return: NULL
+void *
+SyncActionWorker(void *arg)
+{
+    struct SyncPhaseJob *job = arg;
+    struct PathBuilder sourcePath, targetPath;
+    if (PathInit(&sourcePath, job->source->root) != E_OK)
+    {
+        SetFirstError(&job->status, ENOMEM);
+        return NULL;
+    }
+    if (PathInit(&targetPath, job->target->root) != E_OK)
+    {
+        PathFree(&sourcePath);
+        SetFirstError(&job->status, ENOMEM);
+        return NULL;
+    }
+    for (;;)
+    {
+        long index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (index >= job->count)
+            break;
+        if (job->type == SYNC_CHECK)
+        {
+            SyncCheckContent(job, &job->actions[index]);
+            continue;
+        }
+        int status = SyncExecute(job, &job->actions[index], &sourcePath, &targetPath);
+        if (status != E_OK)
+            SetFirstError(&job->status, status);
+    }
+    PathFree(&sourcePath);
+    PathFree(&targetPath);
+    return NULL;
+}
+
+//  function: SyncCheckContent
+//      Carries out one SYNC_CHECK. With both entries set their first length
+//      bytes are compared, with one entry set only its hash is computed and
+//      cached. A file that cannot be read counts as different.
+//  @param: pointer to the shared SyncPhaseJob
+//  @param: pointer to the check
+//  @return: None
+void
+SyncCheckContent(struct SyncPhaseJob *job, struct SyncAction *check)
+{
+    uint64_t hash;
+    if (check->source != NULL && check->target != NULL)
+        check->same = SyncSameContent(job->source, check->source, job->target, check->target, check->length);
+    else if (check->source != NULL)
+        SyncHash(job->source, check->source, check->source->size, &hash);
+    else
+        SyncHash(job->target, check->target, check->target->size, &hash);
+}
+
+//  function: SyncExecute
+//      Carries out one action of the plan. Every call is made relative to the
+//      fd of the directory holding the entry, opened beneath the tree root, so
+//      there is no limit on path length. The path builders only give the full
+//      paths for the log. SYNC_MKDIR without a source entry removes a target 
+//      entry whose type changed, before the new one is created.
+//  @param: pointer to the shared SyncPhaseJob, gives the trees and action type
+//  @param: pointer to the action
+//  @param: pointer to path builder holding the source root
+//  @param: pointer to path builder holding the target root
+//  @return: Integer error code
+int
+SyncExecute(struct SyncPhaseJob *job, struct SyncAction *action, struct PathBuilder *sourcePath, struct PathBuilder *targetPath)
+{
+    struct SyncEntry *from = action->source;
+    struct SyncEntry *to = action->target;
+    char *name = from != NULL ? from->path : to->path;
+    char *targetBase, *sourceBase;
+    int sourceDirFd = E_GENERAL;
+    size_t sourceRoot = sourcePath->length;
+    size_t targetRoot = targetPath->length;
+    int status = PathPush(targetPath, name, strlen(name));
+    if (status == E_OK && from != NULL)
+        status = PathPush(sourcePath, from->path, strlen(from->path));
+    if (status != E_OK)
+        goto executeDone;
+    int targetDirFd = OpenParentBeneath(job->target->fd, name, DISABLE, O_RDONLY, &targetBase);
+    if (targetDirFd == E_GENERAL)
+    {
+        status = errno;
+        if (fLog)
+            LogMessage("\nCould not open the directory of ", targetPath->path, ": ", GetErrorMessage(status), NULL);
+        goto executeDone;
+    }
+    switch (job->type)
+    {
+    case SYNC_MKDIR:
+        if (from == NULL)
+            status = SyncRemove(targetDirFd, targetBase, S_ISDIR(to->mode), targetPath);
+        else
+        {
+            status = mkdirat(targetDirFd, targetBase, createMode) == E_GENERAL ? errno : 
+                     ChmodAt(targetDirFd, targetBase, from->mode & 07777);
+            if (status != E_OK)
+            {
+                if (fLog)
+                    LogMessage("\nCould not create the directory ", targetPath->path, ": ", GetErrorMessage(status), NULL);
+                break;
+            }
+            StatsAdd(STAT_CREATED, 1);
+            status = DurableDirectory(targetDirFd, targetPath->path);
+            if (status == E_OK && fLog)
+                status = LogMessage("\nSuccessfully created directory: ", targetPath->path, NULL);
+        }
+        break;
+    case SYNC_RENAME:
+    {
+        // The file was moved in the source, move the old copy the same way
+        struct PathBuilder oldPath;
+        char *oldBase;
+        if (PathInit(&oldPath, targetPath->path) != E_OK)
+        {
+            status = ENOMEM;
+            break;
+        }
+        PathPop(&oldPath, targetRoot);
+        int oldDirFd = E_GENERAL;
+        status = PathPush(&oldPath, to->path, strlen(to->path));
+        if (status == E_OK)
+        {
+            oldDirFd = OpenParentBeneath(job->target->fd, to->path, DISABLE, O_RDONLY, &oldBase);
+            if (oldDirFd == E_GENERAL || renameat(oldDirFd, oldBase, targetDirFd, targetBase) == E_GENERAL)
+                status = errno;
+        }
+        if (status != E_OK)
+        {
+            if (fLog)
+                LogMessage("\nCould not rename the file ", oldPath.path, ": ", GetErrorMessage(status), NULL);
+        }
+        else
+        {
+            StatsAdd(STAT_UPDATED, 1);
+            size_t oldParent = ParentLength(to->path);
+            status = DurableDirectory(targetDirFd, targetPath->path);
+            if (status == E_OK && (oldParent != ParentLength(name) || strncmp(to->path, name, oldParent) != 0))
+                status = DurableDirectory(oldDirFd, oldPath.path);
+            if (status == E_OK && fLog)
+                status = LogMessage("\nSuccessfully renamed ", oldPath.path, " to ", targetPath->path, NULL);
+        }
+        if (oldDirFd != E_GENERAL && oldDirFd != job->target->fd)
+            close(oldDirFd);
+        PathFree(&oldPath);
+        break;
+    }
+    case SYNC_COPY:
+    case SYNC_APPEND:
+        sourceDirFd = OpenParentBeneath(job->source->fd, from->path, DISABLE, O_PATH, &sourceBase);
+        if (sourceDirFd == E_GENERAL)
+        {
+            status = errno;
+            if (fLog)
+                LogMessage("\nCould not open the directory of ", sourcePath->path, ": ", GetErrorMessage(status), NULL);
+        }
+        else
+            status = CopyFileContents(sourceDirFd, sourceBase, targetDirFd, targetBase, job->type == SYNC_COPY ? 0 : to->size, 
+                                      from, sourcePath->path, targetPath->path);
+        break;
+    case SYNC_DELETE:
+        status = SyncRemove(targetDirFd, targetBase, S_ISDIR(to->mode), targetPath);
+        break;
+    case SYNC_CHMOD:
+        status = ChmodAt(targetDirFd, targetBase, from->mode & 07777);
+        if (status != E_OK)
+        {
+            if (fLog)
+                LogMessage("\nCould not change the mode of ", targetPath->path, ": ", GetErrorMessage(status), NULL);
+        }
+        else
+            StatsAdd(STAT_UPDATED, 1);
+        break;
+    }
+    if (targetDirFd != job->target->fd)
+        close(targetDirFd);
+    if (sourceDirFd != E_GENERAL && sourceDirFd != job->source->fd)
+        close(sourceDirFd);
+    executeDone:
+        PathPop(sourcePath, sourceRoot);
+        PathPop(targetPath, targetRoot);
+        return status;
+}
+
+//  function: SyncRemove
+//      Removes an entry of the target relative to the fd of its directory. 
+//      A directory that is not empty is emptied with BulkDeleteAt first.
+//  @param: Integer fd of the directory holding the entry
+//  @param: pointer to the entry name
+//  @param: Integer ENABLE if the entry is a directory
+//  @param: pointer to path builder holding the full path, used for logging
+//  @return: Integer error code
+int
+SyncRemove(int dirFd, char *name, int isDirectory, struct PathBuilder *path)
+{
+    int status = unlinkat(dirFd, name, isDirectory ? AT_REMOVEDIR : 0) == E_GENERAL ? errno : E_OK;
+    if (isDirectory && (status == ENOTEMPTY || status == EEXIST))
+    {
+        int fd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == E_GENERAL)
+            status = errno;
+        else
+        {
+            status = BulkDeleteAt(fd, path);
+            close(fd);
+            if (status == E_OK && unlinkat(dirFd, name, AT_REMOVEDIR) == E_GENERAL)
+                status = errno;
+        }
+    }
+    if (status != E_OK)
+    {
+        if (fLog)
+            LogMessage("\nCould not remove ", path->path, ": ", GetErrorMessage(status), NULL);
+        return status;
+    }
+    StatsAdd(STAT_DELETED, 1);
+    status = DurableDirectory(dirFd, path->path);
+    if (status == E_OK && fLog)
+        status = LogMessage(isDirectory ? "\nSuccessfully removed directory and its contents: " : "\nSuccessfully removed file: ", path->path, NULL);
+    return status;
+}
+
+//  function: CopyFileContents
+//      Copies a file from the given offset on, using copy_file_range so the
+//      data does not pass through user space (and is reflinked where the 
+//      filesystem supports it). With offset 0 the target is created or 
+//      truncated, otherwise only the tail is appended. The target gets the 
+//      mode and mtime of the source entry. Both files are opened relative to
+//      the fd of their directory.
+//  @param: Integer fd of the source directory
+//  @param: pointer to source file name
+//  @param: Integer fd of the target directory
+//  @param: pointer to target file name
+//  @param: offset to start copying from
+//  @param: pointer to the source entry, gives size, mode and mtime
+//  @param: pointer to full source path, used for logging
+//  @param: pointer to full target path, used for logging
+//  @return: Integer error code
+int
+CopyFileContents(int sourceDirFd, char *sourceName, int targetDirFd, char *targetName, off_t offset, struct SyncEntry *entry, 
+                 char *sourcePath, char *targetPath)
+{
+    int status = E_OK;
+    int in = openat(sourceDirFd, sourceName, O_RDONLY | O_NOFOLLOW);
+    if (in == E_GENERAL)
+        goto copyError;
+    // O_NOFOLLOW so a symbolic link left in the target is never written through
+    int out = offset == 0 ? openat(targetDirFd, targetName, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, entry->mode & 07777) : 
+                            openat(targetDirFd, targetName, O_WRONLY | O_NOFOLLOW);
+    if (out == E_GENERAL)
+    {
+        status = errno;
+        close(in);
+        errno = status;
+        goto copyError;
+    }
+    posix_fadvise(in, offset, 0, POSIX_FADV_SEQUENTIAL);
+    loff_t inOffset = offset, outOffset = offset;
+    int useCopyRange = ENABLE;
+    while (inOffset < entry->size && status == E_OK)
+    {
+        size_t chunk = entry->size - inOffset < COPY_CHUNK_SIZE ? entry->size - inOffset : COPY_CHUNK_SIZE;
+        ssize_t copied = E_GENERAL;
+        if (useCopyRange)
+        {
+            copied = copy_file_range(in, &inOffset, out, &outOffset, chunk, 0);
+            if (copied == E_GENERAL && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            {
+                useCopyRange = DISABLE;     // Not supported between these files, copy through a buffer instead
+                continue;
+            }
+        }
+        else
+        {
+            char buffer[HASH_BUF_SIZE];
+            copied = pread(in, buffer, chunk < HASH_BUF_SIZE ? chunk : HASH_BUF_SIZE, inOffset);
+            if (copied > 0)
+                copied = pwrite(out, buffer, copied, outOffset);
+            if (copied > 0)
+            {
+                inOffset += copied;
+                outOffset += copied;
+            }
+        }
+        if (copied == E_GENERAL)
+            status = errno;
+        else if (copied == 0)
+            break;          // Source shrank while copying
+        else
+            StatsAdd(STAT_BYTES_WRITTEN, copied);
+    }
+    if (status == E_OK && offset == 0 && fchmod(out, entry->mode & 07777) == E_GENERAL)
+        status = errno;     // O_CREAT does not change the mode of a file that already existed
+    if (status == E_OK)
+    {
+        struct timespec times[2] = {{0, UTIME_OMIT}, {entry->mtimeSeconds, entry->mtimeNanoseconds}};
+        if (futimens(out, times) == E_GENERAL)
+            status = errno;
+    }
+    if (status == E_OK)
+        status = DurableFile(out, targetPath);
+    if (status == E_OK && offset == 0)
+        status = DurableDirectory(targetDirFd, targetPath);
+    close(in);
+    if (close(out) == E_GENERAL && status == E_OK)
+        status = errno;
+    if (status != E_OK)
+    {
+        errno = status;
+        goto copyError;
+    }
+    StatsAdd(offset == 0 ? STAT_CREATED : STAT_UPDATED, 1);
+    if (fLog)
+        return LogMessage(offset == 0 ? "\nCopied " : "\nAppended new data of ", sourcePath, " to ", targetPath, NULL);
+    return E_OK;
+    copyError:
+        status = errno;
+        if (fLog)
+            LogMessage("\nCould not copy ", sourcePath, " to ", targetPath, ": ", GetErrorMessage(status), NULL);
+        return status;
+}
+
+//  function: GarbageCollect
+//      Enforces a retention budget on a tree. Files older than --ttl are 
+//      deleted during a single parallel walk. With --max-size or --min-free,
+//      the walk also keeps the oldest files (by atime or mtime, see --by) in a
+//      bounded heap, and once the walk is done they are deleted oldest first
+//      until the tree is small enough or the filesystem has enough free space.
+//      Directories that become empty are removed on the way back up. If the
+//      heap was not enough, another round is walked for the rest.
+//  @param: pointer to root directory path
+//  @return: Integer error code
+int
+GarbageCollect(char *root)
+{
+    struct GcJob job;
+    off_t freed = 0;
+    long deleted = 0, pruned = 0;
+    int status = E_OK;
+    int64_t cutoff = gcTtl >= 0 ? time(NULL) - gcTtl : 0;
+    memset(&job, 0, sizeof(job));
+    job.root = root;
+    job.collect = gcMaxSize >= 0 || gcMinFree >= 0;
+    if (job.collect)
+    {
+        job.heap = malloc(GC_MAX_CANDIDATES * sizeof(struct GcCandidate));
+        if (job.heap == NULL)
+            return ENOMEM;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    for (;;)
+    {
+        job.count = job.totalBytes = job.freedBytes = 0;
+        job.newest = INT64_MAX;
+        job.overflowed = DISABLE;
+        job.cutoff = cutoff;
+        job.deletedFiles = job.prunedDirectories = 0;
+        status = WalkTree(root, GcVisit, GcLeave, &job, GetThreadCount(MAX_THREADS));
+
+        off_t needed = 0;
+        if (gcMaxSize >= 0 && job.totalBytes > gcMaxSize)
+            needed = job.totalBytes - gcMaxSize;
+        if (gcMinFree >= 0)
+        {
+            struct statvfs fsInfo;
+            if (statvfs(root, &fsInfo) == E_OK && (off_t) (fsInfo.f_bavail * fsInfo.f_frsize) < gcMinFree &&
+                gcMinFree - (off_t) (fsInfo.f_bavail * fsInfo.f_frsize) > needed)
+                needed = gcMinFree - fsInfo.f_bavail * fsInfo.f_frsize;
+        }
+        off_t roundFreed = 0;
+        if (needed > 0)
+        {
+            int deleteStatus = GcDeleteOldest(&job, needed, &roundFreed);
+            if (status == E_OK)
+                status = deleteStatus;
+        }
+        for (long i = 0; i < job.count; i ++)
+            free(job.heap[i].path);
+        freed += job.freedBytes;
+        deleted += job.deletedFiles;
+        pruned += job.prunedDirectories;
+        // Done when the target is met, when the heap saw every file, or when nothing could be deleted
+        if (status != E_OK || roundFreed >= needed || !job.overflowed || roundFreed == 0)
+            break;
+        cutoff = 0;     // Old files are gone already, no need to check again
+    }
+    pthread_mutex_destroy(&job.lock);
+    free(job.heap);
+    if (fLog)
+    {
+        char numbers[3][24];
+        FormatLong(numbers[0], freed);
+        FormatLong(numbers[1], deleted);
+        FormatLong(numbers[2], pruned);
+        if (status != E_OK)
+        {
+            LogMessage("\nGarbage collection of ", root, " incomplete: ", GetErrorMessage(status), NULL);
+            return status;
+        }
+        return LogMessage("\nGarbage collection of ", root, " freed ", numbers[0], " bytes, removed ", numbers[1],
+                          " files and ", numbers[2], " empty directories", NULL);
+    }
+    return status;
+}
+
+//  function: GcVisit
+//      Walk visitor for GarbageCollect. Deletes files past the TTL right away
+//      and offers the others as candidates for the size targets.
+//  @param: pointer to the Walker
+//  @param: pointer to the directory node
+//  @param: pointer to the entry name
+//  @param: d_type of the entry
+//  @return: WALK_DESCEND for directories, WALK_CONTINUE otherwise
+int
+GcVisit(struct Walker *walker, struct WalkNode *directory, char *name, unsigned char type)
+{
+    struct GcJob *job = walker->context;
+    struct statx fileInfo;
+    StatsAdd(STAT_SCANNED, 1);
+    if (type == DT_DIR)
+        return WALK_DESCEND;
+    if (type != DT_REG)
+        return WALK_CONTINUE;      // Links and special files take no space worth collecting
+    if (statx(directory->fd, name, AT_SYMLINK_NOFOLLOW, STATX_ATIME | STATX_MTIME | STATX_BLOCKS, &fileInfo) == E_GENERAL)
+    {
+        if (errno != ENOENT)    // Already gone, e.g. removed by the application using the cache
+            SetFirstError(&walker->status, errno);
+        return WALK_CONTINUE;
+    }
+    int64_t fileTime = fGcByAtime ? fileInfo.stx_atime.tv_sec : fileInfo.stx_mtime.tv_sec;
+    off_t bytes = fileInfo.stx_blocks * 512;
+    if (fileTime < job->cutoff)
+    {
+        if (unlinkat(directory->fd, name, 0) == E_GENERAL)
+        {
+            if (errno != ENOENT)
+                SetFirstError(&walker->status, errno);
+            return WALK_CONTINUE;
+        }
+        __atomic_fetch_add(&job->freedBytes, bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&job->deletedFiles, 1, __ATOMIC_RELAXED);
+        StatsAdd(STAT_DELETED, 1);
+        StatsAdd(STAT_BYTES_FREED, bytes);
+        directory->modified = ENABLE;
+        if (fLog)
+        {
+            struct PathBuilder path;
+            if (PathInit(&path, job->root) == E_OK)
+            {
+                if (WalkRelativePath(directory, &path) == E_OK && PathPush(&path, name, strlen(name)) == E_OK)
+                    LogMessage("\nRemoved expired file: ", path.path, NULL);
+                PathFree(&path);
+            }
+        }
+        return WALK_CONTINUE;
+    }
+    __atomic_fetch_add(&job->totalBytes, bytes, __ATOMIC_RELAXED);
+    if (job->collect)
+    {
+        int status = GcOffer(job, fileTime, bytes, directory, name);
+        if (status != E_OK)
+            SetFirstError(&walker->status, status);
+    }
+    return WALK_CONTINUE;
+}
+
+//  function: GcLeave
+//      Walk leave callback for GarbageCollect. A directory in which files were
+//      deleted is synced (see --durability) and removed if it is now empty.
+//  @param: pointer to the Walker
+//  @param: pointer to the finished directory node
+//  @return: None
+void
+GcLeave(struct Walker *walker, struct WalkNode *node)
+{
+    struct GcJob *job = walker->context;
+    if (!__atomic_load_n(&node->modified, __ATOMIC_RELAXED) || node->fd == E_GENERAL)
+        return;
+    DurableDirectory(node->fd, node->name);
+    if (node->parent == NULL)
+        return;     // Never remove the root itself
+    if (unlinkat(node->parent->fd, node->name, AT_REMOVEDIR) == E_GENERAL)
+        return;     // Most likely not empty, which is fine
+    __atomic_fetch_add(&job->prunedDirectories, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&node->parent->modified, ENABLE, __ATOMIC_RELAXED);
+    StatsAdd(STAT_DELETED, 1);
+    if (fLog)
+    {
+        struct PathBuilder path;
+        if (PathInit(&path, job->root) == E_OK)
+        {
+            if (WalkRelativePath(node, &path) == E_OK)
+                LogMessage("\nRemoved empty directory: ", path.path, NULL);
+            PathFree(&path);
+        }
+    }
+}
+
+//  function: GcOffer
+//      Offers a file to the candidate heap. While the heap has room every file
+//      goes in, afterwards a file only goes in if it is older than the newest
+//      candidate, which it then replaces.
+//  @param: pointer to the GcJob
+//  @param: atime or mtime of the file
+//  @param: space the file takes
+//  @param: pointer to the directory node of the file
+//  @param: pointer to the file name
+//  @return: Integer error code
+int
+GcOffer(struct GcJob *job, int64_t fileTime, off_t bytes, struct WalkNode *directory, char *name)
+{
+    if (fileTime >= __atomic_load_n(&job->newest, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&job->overflowed, ENABLE, __ATOMIC_RELAXED);   // Cheap check without the lock, the heap is full of older files
+        return E_OK;
+    }
+    struct PathBuilder path;
+    if (PathInit(&path, "") != E_OK)
+        return ENOMEM;
+    int status = WalkRelativePath(directory, &path);
+    if (status == E_OK)
+        status = PathPush(&path, name, strlen(name));
+    if (status != E_OK)
+    {
+        PathFree(&path);
+        return status;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    struct GcCandidate candidate = {fileTime, bytes, path.path};
+    if (job->count < GC_MAX_CANDIDATES)
+    {
+        // Sift up
+        long index = job->count ++;
+        while (index > 0 && job->heap[(index - 1) / 2].time < fileTime)
+        {
+            job->heap[index] = job->heap[(index - 1) / 2];
+            index = (index - 1) / 2;
+        }
+        job->heap[index] = candidate;
+        path.path = NULL;
+    }
+    else if (fileTime < job->heap[0].time)
+    {
+        free(job->heap[0].path);
+        job->heap[0] = candidate;
+        GcSiftDown(job->heap, job->count, 0);
+        job->overflowed = ENABLE;
+        path.path = NULL;
+    }
+    else
+        job->overflowed = ENABLE;
+    if (job->count == GC_MAX_CANDIDATES)
+        __atomic_store_n(&job->newest, job->heap[0].time, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&job->lock);
+    free(path.path);    // Only left set when the candidate was not taken
+    return E_OK;
+}
+
+//  function: GcSiftDown
+//      Restores the max-heap order below an index
+//  @param: pointer to heap
+//  @param: number of entries in the heap
+//  @param: index to start from
+//  @return: None
+void
+GcSiftDown(struct GcCandidate *heap, long count, long index)
+{
+    struct GcCandidate moving = heap[index];
+    for (;;)
+    {
+        long child = 2 * index + 1;
+        if (child >= count)
+            break;
+        if (child + 1 < count && heap[child + 1].time > heap[child].time)
+            child ++;
+        if (heap[child].time <= moving.time)
+            break;
+        heap[index] = heap[child];
+        index = child;
+    }
+    heap[index] = moving;
+}
+
+//  function: GcDeleteOldest
+//      Deletes candidates oldest first until enough space was freed. The heap
+//      is sorted in place by repeatedly moving its top to the end. Every file
+//      is removed relative to the fd of its directory, opened beneath the gc
+//      root, so there is no limit on path length. Files that are gone 
+//      already are skipped, other failures are logged and the deleting goes on.
+//  @param: pointer to the GcJob
+//  @param: number of bytes to free
+//  @param: pointer to where the number of bytes freed is stored
+//  @return: Integer error code of the first failure, E_OK otherwise
+int
+GcDeleteOldest(struct GcJob *job, off_t needed, off_t *freed)
+{
+    struct PathBuilder path;
+    int status = E_OK;
+    *freed = 0;
+    int rootFd = open(job->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd == E_GENERAL)
+        return errno;
+    if (PathInit(&path, job->root) != E_OK)
+    {
+        close(rootFd);
+        return ENOMEM;
+    }
+    for (long end = job->count - 1; end > 0; end --)
+    {
+        struct GcCandidate top = job->heap[0];
+        job->heap[0] = job->heap[end];
+        job->heap[end] = top;
+        GcSiftDown(job->heap, end, 0);
+    }
+    size_t rootLength = path.length;
+    for (long i = 0; i < job->count && *freed < needed; i ++)
+    {
+        char *name = job->heap[i].path, *base;
+        int error = PathPush(&path, name, strlen(name));
+        if (error == ENOMEM)
+        {
+            status = ENOMEM;
+            break;
+        }
+        int dirFd = OpenParentBeneath(rootFd, name, DISABLE, O_RDONLY, &base);
+        if (dirFd == E_GENERAL || unlinkat(dirFd, base, 0) == E_GENERAL)
+            error = errno;
+        if (error == E_OK)
+        {
+            *freed += job->heap[i].bytes;
+            job->deletedFiles ++;
+            StatsAdd(STAT_DELETED, 1);
+            StatsAdd(STAT_BYTES_FREED, job->heap[i].bytes);
+            if (fLog)
+                LogMessage("\nRemoved old file: ", path.path, NULL);
+            GcPruneParents(rootFd, dirFd, &path, path.length - strlen(name), job);
+        }
+        else if (error != ENOENT)
+        {
+            SetFirstError(&status, error);
+            if (fLog)
+                LogMessage("\nCould not remove old file ", path.path, ": ", GetErrorMessage(error), NULL);
+        }
+        if (dirFd != E_GENERAL && dirFd != rootFd)
+            close(dirFd);
+        PathPop(&path, rootLength);
+    }
+    job->freedBytes += *freed;
+    PathFree(&path);
+    close(rootFd);
+    return status;
+}
+
+//  function: GcPruneParents
+//      Removes the directories above a deleted file for as long as they are
+//      empty, stopping below the gc root. Each directory is removed relative
+//      to the fd of its own parent.
+//  @param: Integer fd of the gc root
+//  @param: Integer fd of the directory the file was deleted from
+//  @param: pointer to path builder holding the full path of the deleted 
+//          file, the caller pops it back to the root afterwards
+//  @param: offset in that path where the part relative to the root starts
+//  @param: pointer to the GcJob, for the counters
+//  @return: None
+void
+GcPruneParents(int rootFd, int dirFd, struct PathBuilder *path, size_t relativeStart, struct GcJob *job)
+{
+    DurableDirectory(dirFd, path->path);    // The directory of the deleted file, see --durability
+    size_t length = ParentLength(path->path + relativeStart);
+    while (length > 0)
+    {
+        char *base;
+        PathPop(path, relativeStart + length);
+        int parentFd = OpenParentBeneath(rootFd, path->path + relativeStart, DISABLE, O_RDONLY, &base);
+        if (parentFd == E_GENERAL)
+            break;
+        if (unlinkat(parentFd, base, AT_REMOVEDIR) == E_GENERAL)
+        {
+            if (parentFd != rootFd)
+                close(parentFd);
+            break;      // Not empty, so none of the directories above are either
+        }
+        job->prunedDirectories ++;
+        StatsAdd(STAT_DELETED, 1);
+        if (fLog)
+            LogMessage("\nRemoved empty directory: ", path->path, NULL);
+        DurableDirectory(parentFd, path->path);
+        if (parentFd != rootFd)
+            close(parentFd);
+        length = ParentLength(path->path + relativeStart);
+    }
+}
+
+//  function: StatsOpen
+//      Creates the stats page given with --stats or --stats-file and maps it,
+//      so the workers can publish their progress for --top. The header is 
+//      written once here, after that only the counters change.
+//  @param: None
+//  @return: Integer error code
+int
+StatsOpen()
+{
+    char pid[24];
+    FormatLong(pid, getpid());
+    if (statsFileName == NULL)
+    {
+        statsFileName = StatsDefaultName(pid);
+        fStatsUnlink = ENABLE;     // Our own name, not left behind once we are done
+    }
+    if (statsFileName == NULL)
+        return ENOMEM;
+    // The free space of the first target's filesystem shows progress of deletes that do not count bytes.
+    // Its parent is watched, the target itself may be the thing being deleted.
+    struct statvfs fsInfo;
+    char *watchPath = NULL;
+    if (operationCount > 0)
+    {
+        char *workingDirectory = getcwd(NULL, 0);
+        watchPath = NormalizePath(operations[0].path, workingDirectory);
+        free(workingDirectory);
+        if (watchPath == NULL && fLog)
+            LogMessage("\nNot watching free space, could not resolve ", operations[0].path, NULL);
+    }
+    if (watchPath != NULL)
+    {
+        watchPath[ParentLength(watchPath)] = '\0';
+        while (statvfs(watchPath, &fsInfo) == E_GENERAL && ParentLength(watchPath) > 0)
+            watchPath[ParentLength(watchPath)] = '\0';     // Target may not exist yet
+    }
+    size_t watchLength = watchPath == NULL ? 0 : strlen(watchPath);
+    size_t pageSize = sizeof(struct StatsPage) + watchLength + 1;
+
+    // The default name lives in a world writable directory, never follow or reuse someone else's file there
+    int flags = fStatsUnlink ? O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW : O_RDWR | O_CREAT | O_TRUNC;
+    int fd = open(statsFileName, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == E_GENERAL && errno == EEXIST && fStatsUnlink && unlink(statsFileName) == E_OK)
+        fd = open(statsFileName, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);    // Left over by an earlier process with our pid
+    if (fd == E_GENERAL)
+        goto statsError;
+    if (ftruncate(fd, pageSize) == E_GENERAL)
+    {
+        int status = errno;
+        close(fd);
+        errno = status;
+        goto statsError;
+    }
+    struct StatsPage *page = mmap(NULL, pageSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED)
+        goto statsError;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    page->pid = getpid();
+    page->startTime = now.tv_sec;
+    if (watchPath != NULL)
+    {
+        memcpy(page + 1, watchPath, watchLength + 1);
+        page->watchLength = watchLength;
+        page->freeAtStart = (uint64_t) fsInfo.f_bavail * fsInfo.f_frsize;
+        free(watchPath);
+    }
+    memcpy(page->magic, STATS_MAGIC, sizeof(page->magic));     // Last, a reader that sees it sees the rest
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    statsPage = page;
+    statsPageSize = pageSize;
+    return E_OK;
+    statsError:
+    {
+        int status = errno;
+        free(watchPath);
+        if (fLog)
+            LogMessage("\nCould not create stats file ", statsFileName, ": ", GetErrorMessage(status), NULL);
+        return status;
+    }
+}
+
+//  function: StatsClose
+//      Marks the stats page finished, so --top prints its last line and 
+//      stops, then unmaps it
+//  @param: None
+//  @return: None
+void
+StatsClose()
+{
+    if (statsPage == NULL)
+        return;
+    __atomic_store_n(&statsPage->finished, ENABLE, __ATOMIC_RELEASE);
+    munmap(statsPage, statsPageSize);
+    statsPage = NULL;
+    if (fStatsUnlink)
+        unlink(statsFileName);
+}
+
+//  function: StatsAdd
+//      Adds to one of the published counters. Called on the hot paths, so it 
+//      is a single relaxed atomic add, and nothing at all without --stats. 
+//      Every counter has its own cache line, so workers bumping different 
+//      counters do not slow each other down.
+//  @param: Integer counter, one of the STAT_ defines
+//  @param: amount to add
+//  @return: None
+void
+StatsAdd(int counter, long amount)
+{
+    if (statsPage != NULL)
+        __atomic_fetch_add(&statsPage->counters[counter].value, amount, __ATOMIC_RELAXED);
+}
+
+//  function: StatsTop
+//      Follows the stats page of a running my_bfm and prints one line per 
+//      second with the counters, the rate of completed entries and, when the
+//      amount of work is known, an estimate of the time left. The page is 
+//      only read, so watching costs the job nothing.
+//  @param: pointer to pid of the job, or path of its stats file
+//  @return: Integer error code
+int
+StatsTop(char *target)
+{
+    char *path = target;
+    char *end;
+    strtol(target, &end, 10);
+    if (*end == '\0' && end != target)
+        path = StatsDefaultName(target);
+    if (path == NULL)
+        return ENOMEM;
+    int status = E_OK;
+    struct stat fileInfo;
+    int fd = open(path, O_RDONLY);
+    if (fd == E_GENERAL || fstat(fd, &fileInfo) == E_GENERAL)
+        status = errno;
+    else if (fileInfo.st_size < (off_t) sizeof(struct StatsPage))
+        status = EINVAL;        // Not a stats file
+    if (status != E_OK)
+    {
+        if (fd != E_GENERAL)
+            close(fd);
+        if (path != target)
+            free(path);
+        return status;
+    }
+    size_t pageSize = fileInfo.st_size;
+    struct StatsPage *page = mmap(NULL, pageSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (path != target)
+        free(path);
+    if (page == MAP_FAILED)
+        return errno;
+    if (memcmp(page->magic, STATS_MAGIC, sizeof(page->magic)) != 0)
+    {
+        munmap(page, pageSize);
+        return EINVAL;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    char *watchPath = (char *) (page + 1);
+    if (page->watchLength == 0 || page->watchLength >= pageSize - sizeof(struct StatsPage) || watchPath[page->watchLength] != '\0')
+        watchPath = NULL;       // Nothing watched, or not what StatsOpen writes
+    uint64_t previous[STATS_COUNTERS];
+    struct timespec before, now;
+    for (int i = 0; i < STATS_COUNTERS; i ++)
+        previous[i] = __atomic_load_n(&page->counters[i].value, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &before);
+    int finished = DISABLE;
+    while (!finished && status == E_OK)
+    {
+        struct timespec interval = {STATS_INTERVAL, 0};
+        nanosleep(&interval, NULL);
+        // Stop after this line when the job is done or gone
+        finished = __atomic_load_n(&page->finished, __ATOMIC_ACQUIRE) || (kill(page->pid, 0) == E_GENERAL && errno == ESRCH);
+        uint64_t current[STATS_COUNTERS];
+        for (int i = 0; i < STATS_COUNTERS; i ++)
+            current[i] = __atomic_load_n(&page->counters[i].value, __ATOMIC_RELAXED);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double seconds = (now.tv_sec - before.tv_sec) + (now.tv_nsec - before.tv_nsec) / 1e9;
+        uint64_t done = current[STAT_CREATED] + current[STAT_UPDATED] + current[STAT_DELETED];
+        uint64_t donePreviously = previous[STAT_CREATED] + previous[STAT_UPDATED] + previous[STAT_DELETED];
+        long rate = seconds > 0 ? (done - donePreviously) / seconds : 0;
+        uint64_t freeGained = 0;
+        struct statvfs fsInfo;
+        if (watchPath != NULL && statvfs(watchPath, &fsInfo) == E_OK && (uint64_t) fsInfo.f_bavail * fsInfo.f_frsize > page->freeAtStart)
+            freeGained = (uint64_t) fsInfo.f_bavail * fsInfo.f_frsize - page->freeAtStart;
+        uint64_t freed = current[STAT_BYTES_FREED] > freeGained ? current[STAT_BYTES_FREED] : freeGained;
+
+        char line[STATS_LINE_LENGTH];
+        size_t length = 0;
+        length = StatsField(line, length, "", time(NULL) - page->startTime, "s");
+        length = StatsField(line, length, " scanned ", current[STAT_SCANNED], "");
+        length = StatsField(line, length, " created ", current[STAT_CREATED], "");
+        length = StatsField(line, length, " updated ", current[STAT_UPDATED], "");
+        length = StatsField(line, length, " deleted ", current[STAT_DELETED], "");
+        length = StatsField(line, length, " written ", current[STAT_BYTES_WRITTEN], "B");
+        length = StatsField(line, length, " freed ", freed, "B");
+        length = StatsField(line, length, " errors ", current[STAT_ERRORS], "");
+        length = StatsField(line, length, " ", rate, "/s");
+        if (finished)
+            length = StatsField(line, length, " done", E_GENERAL, "");
+        else if (current[STAT_PLANNED] > done)
+        {
+            // Deletes discover their work as they go, so for them this is a lower bound
+            length = StatsField(line, length, " left ", current[STAT_PLANNED] - done, "");
+            if (rate > 0)
+                length = StatsField(line, length, " eta ", (current[STAT_PLANNED] - done) / rate, "s");
+        }
+        StatsField(line, length, "\n", E_GENERAL, "");
+        status = PrintMessage(line, NULL);
+        memcpy(previous, current, sizeof(previous));
+        before = now;
+    }
+    munmap(page, pageSize);
+    return status;
+}
+
+//  function: StatsField
+//      Appends a label and a number to a line of --top output
+//  @param: pointer to line buffer of STATS_LINE_LENGTH bytes
+//  @param: length of the line so far
+//  @param: pointer to label
+//  @param: number to append after the label, E_GENERAL for none
+//  @param: pointer to unit appended after the number
+//  @return: new length of the line
+size_t
+StatsField(char *line, size_t length, const char *label, long number, const char *unit)
+{
+    char digits[24] = "";
+    if (number != E_GENERAL)
+        FormatLong(digits, number);
+    size_t labelLength = strlen(label), digitsLength = strlen(digits), unitLength = number != E_GENERAL ? strlen(unit) : 0;
+    if (length + labelLength + digitsLength + unitLength >= STATS_LINE_LENGTH)
+        return length;
+    memcpy(line + length, label, labelLength);
+    memcpy(line + length + labelLength, digits, digitsLength);
+    memcpy(line + length + labelLength + digitsLength, unit, unitLength);
+    length += labelLength + digitsLength + unitLength;
+    line[length] = '\0';
+    return length;
+}
+
+//  function: StatsDefaultName
+//      Builds the name of the stats file of a process started with --stats
+//  @param: pointer to the pid as a string
+//  @return: pointer to newly allocated path, NULL if out of memory
+char *
+StatsDefaultName(char *pid)
+{
+    struct PathBuilder path;
+    if (PathInit(&path, STATS_DIRECTORY "/my_bfm.") != E_OK)
+        return NULL;
+    if (PathAppend(&path, pid, strlen(pid)) != E_OK || PathAppend(&path, ".stats", 6) != E_OK)
+        PathFree(&path);
+    return path.path;
+}
+
+//  function: SwapDirectories
+//      Publishes a staged tree by exchanging it with the live one in a single
+//      renameat2(RENAME_EXCHANGE), so the live path always has complete 
+//      content. Afterwards the old tree sits at the staged path. If the live 
+//      path does not exist yet, the staged tree is simply renamed to it. With
+//      --reap the old tree is moved aside and removed by a background process.
+//  @param: pointer to path of the staged tree
+//  @param: pointer to path of the live tree
+//  @param: Integer ENABLE to reap the old tree
+//  @return: Integer error code
+int
+SwapDirectories(char *stagedPath, char *livePath, int reap)
+{
+    int status = E_OK;
+    int exchanged = ENABLE;
+    if (renameat2(AT_FDCWD, stagedPath, AT_FDCWD, livePath, RENAME_EXCHANGE) == E_GENERAL)
+    {
+        status = errno;
+        if (status == ENOENT && access(stagedPath, F_OK) == E_OK)
+        {
+            // Nothing is live yet, this is the first publish
+            exchanged = DISABLE;
+            status = renameat2(AT_FDCWD, stagedPath, AT_FDCWD, livePath, RENAME_NOREPLACE) == E_GENERAL ? errno : E_OK;
+        }
+        if (status != E_OK)
+        {
+            if (fLog)
+                LogMessage("\nCould not swap ", stagedPath, " with ", livePath, ": ", GetErrorMessage(status), NULL);
+            return status;
+        }
+    }
+    StatsAdd(STAT_UPDATED, 1);
+    status = DurableParent(livePath, stagedPath);
+    if (status != E_OK)
+        return status;
+    if (fLog)
+    {
+        if (exchanged)
+            status = LogMessage("\nSwapped ", stagedPath, " into ", livePath, NULL);
+        else
+            status = LogMessage("\nPublished ", stagedPath, " as ", livePath, NULL);
+    }
+    if (status == E_OK && exchanged && reap)
+        status = ReapDirectory(stagedPath);
+    return status;
+}
+
+//  function: ReapDirectory
+//      Removes a directory tree without making the caller wait for it. The 
+//      tree is first renamed to <path>.reap.<pid>, so the path is free for 
+//      the next staged tree right away. Then a detached process with the 
+//      lowest CPU and idle I/O priority runs my_bfm -d on it. The process is
+//      started with a double fork and exec, so it is not a child of ours, 
+//      and it survives us. It keeps none of our file descriptors.
+//  @param: pointer to directory path
+//  @return: Integer error code
+int
+ReapDirectory(char *path)
+{
+    struct PathBuilder reapPath;
+    char pid[24];
+    int status = E_OK;
+    if (PathInit(&reapPath, path) != E_OK)
+        return ENOMEM;
+    while (reapPath.length > 1 && reapPath.path[reapPath.length - 1] == '/')
+        PathPop(&reapPath, reapPath.length - 1);
+    FormatLong(pid, getpid());
+    status = PathAppend(&reapPath, ".reap.", 6);
+    if (status == E_OK)
+        status = PathAppend(&reapPath, pid, strlen(pid));
+    if (status != E_OK)
+        goto reapError;
+    if (rename(path, reapPath.path) == E_GENERAL)
+        status = errno;
+    else
+        status = DurableParent(reapPath.path, NULL);
+    if (status != E_OK)
+        goto reapError;
+    // Everything the children need is prepared here, after fork only async signal safe calls are made
+    char *arguments[] = {"my_bfm", "-d", reapPath.path, NULL, NULL, NULL};
+    struct rlimit fileLimit;
+    if (getrlimit(RLIMIT_NOFILE, &fileLimit) == E_GENERAL || fileLimit.rlim_cur == RLIM_INFINITY)
+        fileLimit.rlim_cur = 1024;
+    if (fLog)
+    {
+        arguments[1] = "-l";
+        arguments[2] = logFileName;
+        arguments[3] = "-d";
+        arguments[4] = reapPath.path;
+    }
+    pid_t child = fork();
+    if (child == E_GENERAL)
+    {
+        status = errno;
+        goto reapError;
+    }
+    if (child == 0)
+    {
+        setsid();
+        if (fork() != 0)
+            _exit(E_OK);    // The grandchild is adopted by init
+        setpriority(PRIO_PROCESS, 0, REAP_NICE);
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+        int nullFd = open("/dev/null", O_RDWR);
+        if (nullFd != E_GENERAL)
+        {
+            dup2(nullFd, STDIN_FILENO);
+            dup2(nullFd, STDOUT_FILENO);
+            dup2(nullFd, STDERR_FILENO);
+        }
+        // Most fds are opened without O_CLOEXEC, so drop every inherited one
+        if (syscall(SYS_close_range, 3, ~0U, 0) == E_GENERAL)
+        {
+            for (rlim_t fd = 3; fd < fileLimit.rlim_cur; fd ++)
+                close(fd);
+        }
+        execv("/proc/self/exe", arguments);
+        _exit(errno);
+    }
+    waitpid(child, NULL, 0);
+    if (fLog)
+        status = LogMessage("\nRemoving ", reapPath.path, " in the background", NULL);
+    PathFree(&reapPath);
+    return status;
+    reapError:
+        if (fLog)
+            LogMessage("\nCould not hand ", path, " to the background remover: ", GetErrorMessage(status), NULL);
+        PathFree(&reapPath);
+        return status;
+}
+
+//  function: UpdateMetadata
+//      Applies --chmod, --chown and --touch to every entry of a tree, the 
+//      root included. The tree is walked on a pool of threads and every 
+//      change is made relative to the fd of the directory holding the entry.
+//      Entries that already have the wanted value are left alone, so running
+//      it again over a fixed tree costs only the walk. Directories are 
+//      changed once everything inside them is done, so taking away access 
+//      from a directory does not stop its own contents from being updated.
+//  @param: pointer to root directory path
+//  @return: Integer error code
+int
+UpdateMetadata(char *root)
+{
+    struct MetaJob job;
+    memset(&job, 0, sizeof(job));
+    job.root = root;
+    int status = WalkTree(root, MetaVisit, MetaLeave, &job, GetThreadCount(MAX_THREADS));
+    if (fLog)
+    {
+        char numbers[2][24];
+        FormatLong(numbers[0], job.changed);
+        FormatLong(numbers[1], job.unchanged);
+        if (status != E_OK)
+        {
+            LogMessage("\nMetadata update of ", root, " incomplete: ", GetErrorMessage(status), NULL);
+            return status;
+        }
+        return LogMessage("\nMetadata update of ", root, " changed ", numbers[0], " entries, ", numbers[1],
+                          " were already up to date", NULL);
+    }
+    return status;
+}
+
+//  function: MetaVisit
+//      Walk visitor for UpdateMetadata. Updates everything but directories, 
+//      which are left to MetaLeave.
+//  @param: pointer to the Walker
+//  @param: pointer to the directory node
+//  @param: pointer to the entry name
+//  @param: d_type of the entry
+//  @return: WALK_DESCEND for directories, WALK_CONTINUE otherwise
+int
+MetaVisit(struct Walker *walker, struct WalkNode *directory, char *name, unsigned char type)
+{
+    if (type == DT_DIR)
+        return WALK_DESCEND;
+    MetaApply(walker, directory, name);
+    return WALK_CONTINUE;
+}
+
+//  function: MetaLeave
+//      Walk leave callback for UpdateMetadata. Updates the finished directory
+//      through its parent, or by path for the root.
+//  @param: pointer to the Walker
+//  @param: pointer to the finished directory node
+//  @return: None
+void
+MetaLeave(struct Walker *walker, struct WalkNode *node)
+{
+    MetaApply(walker, node->parent, node->name);
+}
+
+//  function: MetaApply
+//      Reads the mode, owner and times of one entry with statx and changes 
+//      only what differs from the targets. Symbolic links are never followed:
+//      their owner and times are changed, their mode cannot be.
+//  @param: pointer to the Walker
+//  @param: pointer to the directory node holding the entry, NULL for the root
+//  @param: pointer to the entry name
+//  @return: None
+void
+MetaApply(struct Walker *walker, struct WalkNode *directory, char *name)
+{
+    struct MetaJob *job = walker->context;
+    struct statx fileInfo;
+    int dirFd = directory == NULL ? AT_FDCWD : directory->fd;
+    int changed = DISABLE, chowned = DISABLE, status = E_OK;
+    StatsAdd(STAT_SCANNED, 1);
+    if (statx(dirFd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_MTIME, &fileInfo) == E_GENERAL)
+    {
+        if (errno != ENOENT)
+            SetFirstError(&walker->status, errno);
+        return;
+    }
+    int isLink = S_ISLNK(fileInfo.stx_mode);
+    mode_t mode = metaMode != E_GENERAL ? (mode_t) metaMode : fileInfo.stx_mode & 07777;
+    // -1 leaves the owner or group as it is, fchownat skips it the same way
+    if ((metaUid != (uid_t) E_GENERAL && fileInfo.stx_uid != metaUid) || (metaGid != (gid_t) E_GENERAL && fileInfo.stx_gid != metaGid))
+    {
+        if (fchownat(dirFd, name, metaUid, metaGid, AT_SYMLINK_NOFOLLOW) == E_GENERAL)
+            status = errno;
+        else
+            chowned = ENABLE;
+        changed = ENABLE;
+    }
+    // After the chown, which clears the setuid and setgid bits, so they are set again
+    if (!isLink && ((fileInfo.stx_mode & 07777) != mode || (chowned && (mode & (S_ISUID | S_ISGID)))))
+    {
+        // Never through a symbolic link: one swapped in since the statx is skipped
+        int chmodStatus = ChmodAt(dirFd, name, mode);
+        if (chmodStatus != EOPNOTSUPP)
+        {
+            if (chmodStatus != E_OK && status == E_OK)
+                status = chmodStatus;
+            changed = ENABLE;
+        }
+    }
+    // Only the modification time, the walk itself keeps moving directory access times
+    if (metaTime != E_GENERAL && (fileInfo.stx_mtime.tv_sec != metaTime || fileInfo.stx_mtime.tv_nsec != 0))
+    {
+        struct timespec times[2] = {{0, UTIME_OMIT}, {metaTime, 0}};
+        if (utimensat(dirFd, name, times, AT_SYMLINK_NOFOLLOW) == E_GENERAL && status == E_OK)
+            status = errno;
+        changed = ENABLE;
+    }
+    if (status != E_OK && status != ENOENT)
+    {
+        SetFirstError(&walker->status, status);
+        struct PathBuilder path;
+        if (fLog && PathInit(&path, directory == NULL ? name : job->root) == E_OK)
+        {
+            if (directory == NULL || (WalkRelativePath(directory, &path) == E_OK && PathPush(&path, name, strlen(name)) == E_OK))
+                LogMessage("\nCould not update ", path.path, ": ", GetErrorMessage(status), NULL);
+            PathFree(&path);
+        }
+    }
+    else if (changed)
+    {
+        __atomic_fetch_add(&job->changed, 1, __ATOMIC_RELAXED);
+        StatsAdd(STAT_UPDATED, 1);
+    }
+    else
+        __atomic_fetch_add(&job->unchanged, 1, __ATOMIC_RELAXED);
+}
+
+//  function: PackTree
+//      Writes the contents of a directory as one tar stream (GNU format, so 
+//      tar -x can read it). Directories are packed one after the other, but
+//      within a directory the next files are opened and read ahead while the
+//      current one is sent, and file bodies go out with sendfile, so the 
+//      stream runs at sequential bandwidth instead of one metadata round trip
+//      per file.
+//  @param: pointer to directory path
+//  @param: pointer to output path, "-" for stdout
+//  @return: Integer error code
+int
+PackTree(char *directoryPath, char *outputPath)
+{
+    struct PackStream stream;
+    struct PathBuilder relativePath;
+    struct stat outputInfo;
+    int status = E_OK;
+    memset(&stream, 0, sizeof(stream));
+    int dirFd = open(directoryPath, O_RDONLY | O_DIRECTORY);
+    if (dirFd == E_GENERAL)
+        goto packError;
+    stream.fd = strcmp(outputPath, "-") == 0 ? STDOUT_FILENO : open(outputPath, O_WRONLY | O_CREAT | O_TRUNC, createMode);
+    if (stream.fd == E_GENERAL)
+    {
+        status = errno;
+        close(dirFd);
+        errno = status;
+        goto packError;
+    }
+    stream.buffer = malloc(PACK_BUF_SIZE);
+    if (stream.buffer == NULL || PathInit(&relativePath, "") != E_OK)
+    {
+        free(stream.buffer);
+        close(dirFd);
+        if (stream.fd > STDERR_FILENO)
+            close(stream.fd);
+        errno = ENOMEM;
+        goto packError;
+    }
+    if (fstat(stream.fd, &outputInfo) == E_OK && S_ISREG(outputInfo.st_mode))
+    {
+        stream.skipDevice = outputInfo.st_dev;      // Never pack the archive into itself
+        stream.skipInode = outputInfo.st_ino;
+    }
+    status = PackDirectory(dirFd, &relativePath, &stream);
+    if (status == E_OK)
+        status = stream.status;     // A file could not be opened, the archive is incomplete
+    if (status == E_OK)
+    {
+        char trailer[2 * TAR_BLOCK_SIZE];
+        memset(trailer, 0, sizeof(trailer));
+        status = PackWrite(&stream, trailer, sizeof(trailer));  // End of archive marker
+    }
+    if (status == E_OK)
+        status = PackFlush(&stream);
+    if (status == E_OK && stream.fd > STDERR_FILENO)
+        status = DurableFile(stream.fd, outputPath);
+    PathFree(&relativePath);
+    free(stream.buffer);
+    close(dirFd);
+    if (stream.fd > STDERR_FILENO && close(stream.fd) == E_GENERAL && status == E_OK)
+        status = errno;
+    if (status != E_OK)
+    {
+        errno = status;
+        goto packError;
+    }
+    if (fLog)
+        return LogMessage("\nPacked ", directoryPath, " into ", outputPath, NULL);
+    return E_OK;
+    packError:
+        status = errno;
+        if (fLog)
+            LogMessage("\nCould not pack ", directoryPath, ": ", GetErrorMessage(status), NULL);
+        return status;
+}
+
+//  function: PackDirectory
+//      Packs everything inside an open directory. Its entries are read first,
+//      then the files are packed through a window of PACK_WINDOW open files 
+//      whose data the kernel is already fetching, then the subdirectories 
+//      are packed one by one.
+//  @param: Integer fd of the directory
+//  @param: pointer to path builder holding its path inside the archive
+//  @param: pointer to the output stream
+//  @return: Integer error code
+int
+PackDirectory(int dirFd, struct PathBuilder *relativePath, struct PackStream *stream)
+{
+    struct ArenaMark mark = ArenaSave(&threadArena);
+    char *buf = ArenaAlloc(&threadArena, DIRENT_BUF_SIZE);
+    char **files = NULL, **directories = NULL;
+    long fileCount = 0, directoryCount = 0, capacity = 0;
+    int window[PACK_WINDOW];
+    int windowErrors[PACK_WINDOW];
+    int status = buf == NULL ? ENOMEM : E_OK;
+    // Collect the names first, the getdents buffer is reused for every call
+    while (status == E_OK)
+    {
+        long nread = getdents64(dirFd, buf, DIRENT_BUF_SIZE);
+        if (nread == E_GENERAL)
+            status = errno;
+        if (nread <= 0)
+            break;
+        for (long bpos = 0; bpos < nread && status == E_OK; bpos += ((struct linux_dirent64 *) (buf + bpos))->d_reclen)
+        {
+            struct linux_dirent64 *d = (struct linux_dirent64 *) (buf + bpos);
+            char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN)
+            {
+                struct stat fileInfo;
+                if (fstatat(dirFd, name, &fileInfo, AT_SYMLINK_NOFOLLOW) == E_OK)
+                    type = IFTODT(fileInfo.st_mode);
+            }
+            if (type != DT_REG && type != DT_DIR && type != DT_LNK)
+                continue;       // Devices, sockets and fifos are not packed
+            if (fileCount + directoryCount == capacity)
+            {
+                long newCapacity = capacity == 0 ? 256 : 2 * capacity;
+                char **grownFiles = ArenaAlloc(&threadArena, newCapacity * sizeof(char *));
+                char **grownDirectories = ArenaAlloc(&threadArena, newCapacity * sizeof(char *));
+                if (grownFiles == NULL || grownDirectories == NULL)
+                {
+                    status = ENOMEM;
+                    break;
+                }
+                memcpy(grownFiles, files, fileCount * sizeof(char *));
+                memcpy(grownDirectories, directories, directoryCount * sizeof(char *));
+                files = grownFiles;
+                directories = grownDirectories;
+                capacity = newCapacity;
+            }
+            size_t length = strlen(name);
+            char *copy = ArenaAlloc(&threadArena, length + 2);
+            if (copy == NULL)
+            {
+                status = ENOMEM;
+                break;
+            }
+            copy[0] = type;     // Remember the type in front of the name
+            memcpy(copy + 1, name, length + 1);
+            if (type == DT_DIR)
+                directories[directoryCount ++] = copy;
+            else
+                files[fileCount ++] = copy;
+        }
+    }
+
+    long opened = 0, next = 0;
+    for (; next < fileCount && status == E_OK; next ++)
+    {
+        for (; opened < fileCount && opened < next + PACK_WINDOW; opened ++)
+        {
+            window[opened % PACK_WINDOW] = E_GENERAL;
+            if (files[opened][0] != DT_REG)
+                continue;
+            int fd = openat(dirFd, files[opened] + 1, O_RDONLY | O_NOFOLLOW);
+            if (fd != E_GENERAL)
+                posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);   // Start reading it in the background
+            window[opened % PACK_WINDOW] = fd;
+            windowErrors[opened % PACK_WINDOW] = fd == E_GENERAL ? errno : E_OK;
+        }
+        char *name = files[next] + 1;
+        int fd = window[next % PACK_WINDOW];
+        size_t parentLength = relativePath->length;
+        status = PathPush(relativePath, name, strlen(name));
+        if (status != E_OK)
+            ;   // Out of memory, stops the loop
+        else if (files[next][0] == DT_LNK || fd != E_GENERAL)
+            status = PackEntry(stream, dirFd, name, fd, relativePath);
+        else if (windowErrors[next % PACK_WINDOW] != ENOENT)
+        {
+            // Keep packing the rest, but the run fails. Files that vanished since they were listed are skipped.
+            SetFirstError(&stream->status, windowErrors[next % PACK_WINDOW]);
+            if (fLog)
+                LogMessage("\nCould not pack the file ", relativePath->path, ": ", GetErrorMessage(windowErrors[next % PACK_WINDOW]), NULL);
+        }
+        PathPop(relativePath, parentLength);
+        if (fd != E_GENERAL)
+            close(fd);
+    }
+    for (; next < opened; next ++)
+    {
+        if (window[next % PACK_WINDOW] != E_GENERAL)
+            close(window[next % PACK_WINDOW]);  // Still open after an error
+    }
+
+    for (long i = 0; i < directoryCount && status == E_OK; i ++)
+    {
+        char *name = directories[i] + 1;
+        size_t parentLength = relativePath->length;
+        if (PathPush(relativePath, name, strlen(name)) != E_OK)
+        {
+            status = ENOMEM;
+            break;
+        }
+        int childFd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (childFd == E_GENERAL)
+            status = errno == ENOENT ? E_OK : errno;
+        else
+        {
+            status = PackEntry(stream, dirFd, name, childFd, relativePath);
+            if (status == E_OK)
+                status = PackDirectory(childFd, relativePath, stream);
+            close(childFd);
+        }
+        PathPop(relativePath, parentLength);
+    }
+    ArenaRestore(&threadArena, mark);
+    return status;
+}
+
+//  function: PackEntry
+//      Writes the header of one entry and, for a regular file, its data
+//  @param: pointer to the output stream
+//  @param: Integer fd of the directory holding the entry
+//  @param: pointer to entry name
+//  @param: Integer fd of the open entry, E_GENERAL for a symbolic link
+//  @param: pointer to path builder holding the path inside the archive
+//  @return: Integer error code
+int
+PackEntry(struct PackStream *stream, int dirFd, char *name, int fd, struct PathBuilder *relativePath)
+{
+    struct stat fileInfo;
+    char *linkTarget = "";
+    char type;
+    off_t size = 0;
+    int status = fd == E_GENERAL ? fstatat(dirFd, name, &fileInfo, AT_SYMLINK_NOFOLLOW) : fstat(fd, &fileInfo);
+    if (status == E_GENERAL)
+        return errno;
+    StatsAdd(STAT_SCANNED, 1);
+    struct ArenaMark mark = ArenaSave(&threadArena);
+    if (S_ISDIR(fileInfo.st_mode))
+        type = TAR_DIRECTORY;
+    else if (S_ISLNK(fileInfo.st_mode))
+    {
+        // st_size is the target length, but may be 0 (procfs) or change, so grow until it fits
+        size_t capacity = fileInfo.st_size > 0 ? fileInfo.st_size + 1 : PATH_MAX;
+        for (;;)
+        {
+            linkTarget = ArenaAlloc(&threadArena, capacity);
+            ssize_t length = linkTarget == NULL ? E_GENERAL : readlinkat(dirFd, name, linkTarget, capacity);
+            if (length == E_GENERAL)
+            {
+                status = linkTarget == NULL ? ENOMEM : errno;
+                ArenaRestore(&threadArena, mark);
+                return status;
+            }
+            if ((size_t) length < capacity)
+            {
+                linkTarget[length] = '\0';
+                break;
+            }
+            capacity *= 2;
+        }
+        type = TAR_SYMLINK;
+    }
+    else
+    {
+        if (fileInfo.st_dev == stream->skipDevice && fileInfo.st_ino == stream->skipInode)
+            return E_OK;
+        type = TAR_REGULAR;
+        size = fileInfo.st_size;
+    }
+    size_t pathLength = relativePath->length;
+    if (type == TAR_DIRECTORY)
+        status = PathAppend(relativePath, "/", 1);      // tar marks directories with a trailing slash
+    if (status == E_OK)
+        status = PackHeader(stream, relativePath->path, type, &fileInfo, size, linkTarget);
+    ArenaRestore(&threadArena, mark);
+    PathPop(relativePath, pathLength);
+    if (status != E_OK || size == 0)
+        return status;
+    status = PackFlush(stream);     // Headers are buffered, the body goes straight from the file
+    off_t remaining = size;
+    int useSendfile = ENABLE;
+    while (remaining > 0 && status == E_OK)
+    {
+        ssize_t sent = E_GENERAL;
+        if (useSendfile)
+        {
+            sent = sendfile(stream->fd, fd, NULL, remaining);
+            if (sent == E_GENERAL && (errno == EINVAL || errno == ENOSYS))
+            {
+                useSendfile = DISABLE;      // Output does not support it, copy through the buffer
+                continue;
+            }
+        }
+        else
+        {
+            sent = read(fd, stream->buffer, remaining < PACK_BUF_SIZE ? remaining : PACK_BUF_SIZE);
+            if (sent > 0)
+            {
+                stream->used = sent;
+                status = PackFlush(stream);
+            }
+        }
+        if (sent == E_GENERAL)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            status = errno;
+        }
+        else if (sent == 0)
+        {
+            // File shrank while packing, pad with zeros to keep the size in the header
+            memset(stream->buffer, 0, remaining < PACK_BUF_SIZE ? remaining : PACK_BUF_SIZE);
+            sent = remaining < PACK_BUF_SIZE ? remaining : PACK_BUF_SIZE;
+            stream->used = sent;
+            status = PackFlush(stream);
+        }
+        remaining -= sent;
+    }
+    if (status != E_OK)
+        return status;
+    StatsAdd(STAT_BYTES_WRITTEN, size);     // Only once the body is out
+    char padding[TAR_BLOCK_SIZE];
+    memset(padding, 0, sizeof(padding));
+    return PackWrite(stream, padding, (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+}
+
+//  function: PackHeader
+//      Writes a tar header block. Names and link targets longer than the 100
+//      bytes a header holds are sent in GNU long name records in front of it.
+//  @param: pointer to the output stream
+//  @param: pointer to the path inside the archive
+//  @param: tar type flag
+//  @param: pointer to the metadata of the entry
+//  @param: size of the data following the header
+//  @param: pointer to the target of a symbolic link, empty otherwise
+//  @return: Integer error code
+int
+PackHeader(struct PackStream *stream, char *path, char type, struct stat *fileInfo, off_t size, char *linkTarget)
+{
+    struct TarHeader header;
+    size_t pathLength = strlen(path);
+    size_t linkLength = strlen(linkTarget);
+    int status = E_OK;
+    if (pathLength > TAR_NAME_SIZE)
+        status = PackLongRecord(stream, TAR_LONG_NAME, path, pathLength);
+    if (status == E_OK && linkLength > TAR_NAME_SIZE)
+        status = PackLongRecord(stream, TAR_LONG_LINK, linkTarget, linkLength);
+    if (status != E_OK)
+        return status;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.name, path, pathLength < TAR_NAME_SIZE ? pathLength : TAR_NAME_SIZE);
+    memcpy(header.linkname, linkTarget, linkLength < TAR_NAME_SIZE ? linkLength : TAR_NAME_SIZE);
+    TarNumber(header.mode, sizeof(header.mode), fileInfo->st_mode & 07777);
+    TarNumber(header.uid, sizeof(header.uid), fileInfo->st_uid);
+    TarNumber(header.gid, sizeof(header.gid), fileInfo->st_gid);
+    TarNumber(header.size, sizeof(header.size), size);
+    TarNumber(header.mtime, sizeof(header.mtime), fileInfo->st_mtime);
+    header.typeflag = type;
+    memcpy(header.magic, TAR_MAGIC, sizeof(header.magic) + sizeof(header.version));
+    TarChecksum(&header);
+    return PackWrite(stream, &header, sizeof(header));
+}
+
+//  function: PackLongRecord
+//      Writes a GNU long name ('L') or long link ('K') record, a header 
+//      followed by the null terminated value padded to whole blocks
+//  @param: pointer to the output stream
+//  @param: TAR_LONG_NAME or TAR_LONG_LINK
+//  @param: pointer to the value
+//  @param: length of the value
+//  @return: Integer error code
+int
+PackLongRecord(struct PackStream *stream, char type, char *value, size_t length)
+{
+    struct TarHeader header;
+    char padding[TAR_BLOCK_SIZE];
+    memset(&header, 0, sizeof(header));
+    memset(padding, 0, sizeof(padding));
+    strcpy(header.name, "././@LongLink");
+    TarNumber(header.mode, sizeof(header.mode), 0644);
+    TarNumber(header.uid, sizeof(header.uid), 0);
+    TarNumber(header.gid, sizeof(header.gid), 0);
+    TarNumber(header.size, sizeof(header.size), length + 1);
+    TarNumber(header.mtime, sizeof(header.mtime), 0);
+    header.typeflag = type;
+    memcpy(header.magic, TAR_MAGIC, sizeof(header.magic) + sizeof(header.version));
+    TarChecksum(&header);
+    int status = PackWrite(stream, &header, sizeof(header));
+    if (status == E_OK)
+        status = PackWrite(stream, value, length);
+    if (status == E_OK)
+        status = PackWrite(stream, padding, TAR_BLOCK_SIZE - length % TAR_BLOCK_SIZE);  // Includes the terminating null
+    return status;
+}
+
+//  function: PackWrite
+//      Appends bytes to the output buffer, flushing it when full
+//  @param: pointer to the output stream
+//  @param: pointer to the bytes
+//  @param: number of bytes
+//  @return: Integer error code
+int
+PackWrite(struct PackStream *stream, void *data, size_t length)
+{
+    char *bytes = data;
+    while (length > 0)
+    {
+        size_t chunk = PACK_BUF_SIZE - stream->used < length ? PACK_BUF_SIZE - stream->used : length;
+        memcpy(stream->buffer + stream->used, bytes, chunk);
+        stream->used += chunk;
+        bytes += chunk;
+        length -= chunk;
+        if (stream->used == PACK_BUF_SIZE && PackFlush(stream) != E_OK)
+            return errno;
+    }
+    return E_OK;
+}
+
+//  function: PackFlush
+//      Writes out the buffered part of the stream
+//  @param: pointer to the output stream
+//  @return: Integer error code
+int
+PackFlush(struct PackStream *stream)
+{
+    size_t done = 0;
+    while (done < stream->used)
+    {
+        ssize_t written = write(stream->fd, stream->buffer + done, stream->used - done);
+        if (written == E_GENERAL)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        done += written;
+    }
+    stream->used = 0;
+    return E_OK;
+}
+
+//  function: TarNumber
+//      Stores a number in a tar header field, as null terminated octal when
+//      it fits and in the GNU base-256 form otherwise (files over 8 GiB)
+//  @param: pointer to the field
+//  @param: size of the field
+//  @param: value to store
+//  @return: None
+void
+TarNumber(char *field, size_t width, uint64_t value)
+{
+    if (value < (1ULL << (3 * (width - 1))))
+    {
+        field[width - 1] = '\0';
+        for (size_t i = width - 1; i > 0; i --)
+        {
+            field[i - 1] = '0' + (value & 7);
+            value >>= 3;
+        }
+        return;
+    }
+    for (size_t i = width; i > 0; i --)
+    {
+        field[i - 1] = value & 0xff;
+        value >>= 8;
+    }
+    field[0] |= 0x80;
+}
+
+//  function: TarParseNumber
+//      Reads a number from a tar header field, octal or base-256
+//  @param: pointer to the field
+//  @param: size of the field
+//  @return: the value
+uint64_t
+TarParseNumber(char *field, size_t width)
+{
+    uint64_t value = 0;
+    if ((unsigned char) field[0] & 0x80)
+    {
+        value = field[0] & 0x7f;
+        for (size_t i = 1; i < width; i ++)
+            value = (value << 8) | (unsigned char) field[i];
+        return value;
+    }
+    for (size_t i = 0; i < width && field[i] != '\0'; i ++)
+    {
+        if (field[i] >= '0' && field[i] <= '7')
+            value = (value << 3) | (field[i] - '0');
+    }
+    return value;
+}
+
+//  function: TarChecksum
+//      Fills in the checksum of a tar header, the sum of all its bytes with
+//      the checksum field counted as spaces
+//  @param: pointer to the header
+//  @return: the checksum
+unsigned int
+TarChecksum(struct TarHeader *header)
+{
+    unsigned int sum = 0;
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    for (size_t i = 0; i < sizeof(struct TarHeader); i ++)
+        sum += ((unsigned char *) header)[i];
+    TarNumber(header->chksum, 7, sum);
+    header->chksum[7] = ' ';
+    return sum;
+}
+
+//  function: UnpackArchive
+//      Extracts a tar stream written by --pack (or by GNU tar) into a 
+//      directory. The stream is read by this thread, which also creates the
+//      directories in order. Small files are handed with their data to a 
+//      pool of workers that create them in parallel, relative to the 
+//      directory fd. Large files are spliced straight from the input. 
+//      Symbolic links are only created once every file is extracted, so no
+//      later entry can be written through one, then hard links, then 
+//      directory modes are set. A file name that comes again (tar -r) waits
+//      for the earlier copy, so the last one wins.
+//  @param: pointer to archive path, "-" for stdin
+//  @param: pointer to target directory path, created if missing
+//  @return: Integer error code
+int
+UnpackArchive(char *inputPath, char *directoryPath)
+{
+    pthread_t threads[MAX_THREADS];
+    struct UnpackStream stream;
+    struct UnpackQueue queue;
+    struct TarHeader header;
+    struct UnpackDeferred *deferred = NULL;
+    char *longName = NULL, *longLink = NULL;
+    int status = E_OK;
+    memset(&stream, 0, sizeof(stream));
+    memset(&queue, 0, sizeof(queue));
+    if (mkdir(directoryPath, createMode) == E_GENERAL && errno != EEXIST)
+        goto unpackError;
+    queue.rootFd = open(directoryPath, O_RDONLY | O_DIRECTORY);
+    if (queue.rootFd == E_GENERAL)
+        goto unpackError;
+    stream.fd = strcmp(inputPath, "-") == 0 ? STDIN_FILENO : open(inputPath, O_RDONLY);
+    stream.buffer = malloc(PACK_BUF_SIZE);
+    if (stream.fd == E_GENERAL || stream.buffer == NULL)
+    {
+        status = stream.fd == E_GENERAL ? errno : ENOMEM;
+        close(queue.rootFd);
+        if (stream.fd > STDERR_FILENO)
+            close(stream.fd);
+        free(stream.buffer);
+        errno = status;
+        goto unpackError;
+    }
+    posix_fadvise(stream.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.changed, NULL);
+    int threadCount = GetThreadCount(MAX_THREADS);
+    int started = 0;
+    for (; started < threadCount; started ++)
+    {
+        if (pthread_create(&threads[started], NULL, UnpackWorker, &queue) != E_OK)
+            break;      // Go on with the workers we have, without any the reader writes every file
+    }
+
+    while (status == E_OK)
+    {
+        status = UnpackRead(&stream, &header, sizeof(header));
+        if (status != E_OK)
+            break;
+        if (header.name[0] == '\0')
+            break;      // Zero block, end of archive
+        unsigned int expected = TarParseNumber(header.chksum, sizeof(header.chksum));
+        if (TarChecksum(&header) != expected)
+        {
+            status = EILSEQ;
+            break;
+        }
+        off_t size = TarParseNumber(header.size, sizeof(header.size));
+        off_t padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        if (header.typeflag == TAR_LONG_NAME || header.typeflag == TAR_LONG_LINK)
+        {
+            char *value = malloc(size + 1);
+            if (value == NULL)
+            {
+                status = ENOMEM;
+                break;
+            }
+            status = UnpackRead(&stream, value, size);
+            value[size] = '\0';
+            if (header.typeflag == TAR_LONG_NAME)
+            {
+                free(longName);
+                longName = value;
+            }
+            else
+            {
+                free(longLink);
+                longLink = value;
+            }
+            if (status == E_OK)
+                status = UnpackSkip(&stream, padding);
+            continue;
+        }
+
+        // Work out the name, from a long name record, or prefix and name
+        struct PathBuilder name;
+        if (PathInit(&name, "") != E_OK)
+        {
+            status = ENOMEM;
+            break;
+        }
+        if (longName != NULL)
+            status = PathAppend(&name, longName, strlen(longName));
+        else
+        {
+            if (header.prefix[0] != '\0')
+                status = PathPush(&name, header.prefix, strnlen(header.prefix, sizeof(header.prefix)));
+            if (status == E_OK)
+                status = PathPush(&name, header.name, strnlen(header.name, sizeof(header.name)));
+        }
+        if (status != E_OK)
+        {
+            PathFree(&name);
+            break;
+        }
+        while (name.length > 0 && name.path[name.length - 1] == '/')
+            PathPop(&name, name.length - 1);
+        char *relative = name.path;
+        while (relative[0] == '.' && relative[1] == '/')
+            relative += 2;
+        mode_t mode = TarParseNumber(header.mode, sizeof(header.mode)) & 07777;
+        int64_t mtime = TarParseNumber(header.mtime, sizeof(header.mtime));
+        char linkTarget[TAR_NAME_SIZE + 1];
+        memcpy(linkTarget, header.linkname, TAR_NAME_SIZE);
+        linkTarget[TAR_NAME_SIZE] = '\0';
+
+        if (!UnpackSafeName(relative))
+        {
+            if (fLog)
+                LogMessage("\nSkipped unsafe archive entry: ", name.path, NULL);
+            status = UnpackSkip(&stream, size + padding);
+        }
+        else if (header.typeflag == TAR_DIRECTORY)
+        {
+            // Owner keeps full access until the end, so the contents can still be created
+            char *base;
+            int parentFd = OpenParentBeneath(queue.rootFd, relative, ENABLE, O_PATH, &base);
+            if (parentFd == E_GENERAL || (mkdirat(parentFd, base, mode | S_IRWXU) == E_GENERAL && errno != EEXIST))
+                status = errno;
+            if (parentFd != E_GENERAL && parentFd != queue.rootFd)
+                close(parentFd);
+            if (status == E_OK)
+                status = UnpackDefer(&deferred, TAR_DIRECTORY, relative, NULL, mode, mtime);
+            if (status == E_OK)
+                status = UnpackSkip(&stream, size + padding);
+        }
+        else if (header.typeflag == TAR_SYMLINK)
+        {
+            status = UnpackDefer(&deferred, TAR_SYMLINK, relative, longLink != NULL ? longLink : linkTarget, mode, mtime);
+            if (status == E_OK)
+                status = UnpackSkip(&stream, size + padding);
+        }
+        else if (header.typeflag == TAR_HARDLINK)
+        {
+            char *target = longLink != NULL ? longLink : linkTarget;
+            while (target[0] == '.' && target[1] == '/')
+                target += 2;
+            if (!UnpackSafeName(target))
+            {
+                if (fLog)
+                    LogMessage("\nSkipped unsafe archive entry: ", name.path, NULL);
+            }
+            else
+                status = UnpackDefer(&deferred, TAR_HARDLINK, relative, target, mode, mtime);
+            if (status == E_OK)
+                status = UnpackSkip(&stream, size + padding);
+        }
+        else if (header.typeflag == TAR_REGULAR || header.typeflag == TAR_REGULAR_OLD || header.typeflag == TAR_CONTIGUOUS)
+        {
+            status = UnpackWaitRepeated(&queue, relative);
+            if (status == E_OK && size <= UNPACK_INLINE_MAX && started > 0)
+                status = UnpackQueueFile(&queue, &stream, relative, mode, mtime, size);
+            else if (status == E_OK)
+                status = UnpackLargeFile(&queue, &stream, relative, mode, mtime, size);
+            if (status == E_OK)
+                status = UnpackSkip(&stream, padding);
+        }
+        else
+            status = UnpackSkip(&stream, size + padding);   // Devices, fifos, pax records are not restored
+        PathFree(&name);
+        free(longName);
+        free(longLink);
+        longName = longLink = NULL;
+    }
+    free(longName);
+    free(longLink);
+
+    pthread_mutex_lock(&queue.lock);
+    queue.done = ENABLE;
+    pthread_cond_broadcast(&queue.changed);
+    pthread_mutex_unlock(&queue.lock);
+    for (int i = 0; i < started; i ++)
+        pthread_join(threads[i], NULL);
+    if (status == E_OK)
+        status = queue.status;
+    if (status == E_OK)
+        status = UnpackRestore(queue.rootFd, deferred);
+    while (deferred != NULL)
+    {
+        struct UnpackDeferred *next = deferred->next;
+        free(deferred);
+        deferred = next;
+    }
+    if (status == E_OK && durability != DURABILITY_NONE)
+    {
+        // Directory entries all over the tree changed, one syncfs covers them
+        if (durability == DURABILITY_STRICT && syncfs(queue.rootFd) == E_GENERAL)
+            status = errno;
+        else
+            status = DurableDirectory(queue.rootFd, directoryPath);
+    }
+    pthread_cond_destroy(&queue.changed);
+    pthread_mutex_destroy(&queue.lock);
+    free(queue.names);
+    free(stream.buffer);
+    close(queue.rootFd);
+    if (stream.fd > STDERR_FILENO)
+        close(stream.fd);
+    if (status != E_OK)
+    {
+        errno = status;
+        goto unpackError;
+    }
+    if (fLog)
+        return LogMessage("\nUnpacked ", inputPath, " into ", directoryPath, NULL);
+    return E_OK;
+    unpackError:
+        status = errno;
+        if (fLog)
+            LogMessage("\nCould not unpack ", inputPath, ": ", GetErrorMessage(status), NULL);
+        return status;
+}
+
+//  function: UnpackSafeName
+//      Rejects archive names that would land outside the target directory
+//  @param: pointer to the relative name
+//  @return: 1 if the name is safe, 0 otherwise
+int
+UnpackSafeName(char *name)
+{
+    if (name[0] == '/' || name[0] == '\0')
+        return 0;
+    for (char *component = name; *component != '\0'; )
+    {
+        size_t length = strcspn(component, "/");
+        if (length == 2 && component[0] == '.' && component[1] == '.')
+            return 0;
+        component += length;
+        while (*component == '/')
+            component ++;
+    }
+    return 1;
+}
+
+//  function: UnpackQueueFile
+//      Reads the data of a small file and queues it for the workers. Waits 
+//      while too much data is queued, so memory stays bounded.
+//  @param: pointer to the UnpackQueue
+//  @param: pointer to the input stream
+//  @param: pointer to the relative name
+//  @param: mode of the file
+//  @param: mtime of the file
+//  @param: size of the file
+//  @return: Integer error code
+int
+UnpackQueueFile(struct UnpackQueue *queue, struct UnpackStream *stream, char *name, mode_t mode, int64_t mtime, off_t size)
+{
+    size_t nameLength = strlen(name);
+    struct UnpackJob *job = malloc(sizeof(struct UnpackJob) + nameLength + 1 + size);
+    if (job == NULL)
+        return ENOMEM;
+    job->next = NULL;
+    job->mode = mode;
+    job->mtime = mtime;
+    job->size = size;
+    job->name = (char *) (job + 1);
+    job->data = job->name + nameLength + 1;
+    memcpy(job->name, name, nameLength + 1);
+    int status = UnpackRead(stream, job->data, size);
+    if (status != E_OK)
+    {
+        free(job);
+        return status;
+    }
+    pthread_mutex_lock(&queue->lock);
+    while (queue->queuedBytes > UNPACK_QUEUE_BYTES && queue->status == E_OK)
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    if (queue->tail == NULL)
+        queue->head = job;
+    else
+        queue->tail->next = job;
+    queue->tail = job;
+    queue->queuedBytes += size + nameLength;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return E_OK;
+}
+
+//  function: UnpackWaitRepeated
+//      Keeps a later copy of a file (tar -r appends them) from being written
+//      while a worker may still write an earlier one. The reader records a 
+//      hash of every file name, and when a name comes again it waits until 
+//      everything queued so far is written. A hash collision only costs a 
+//      wait that was not needed.
+//  @param: pointer to the UnpackQueue
+//  @param: pointer to the relative name
+//  @return: Integer error code
+int
+UnpackWaitRepeated(struct UnpackQueue *queue, char *name)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (unsigned char *byte = (unsigned char *) name; *byte != '\0'; byte ++)
+        hash = (hash ^ *byte) * FNV_PRIME;
+    hash |= 1;      // Never 0, which marks a free slot
+    if (2 * (queue->nameCount + 1) > queue->nameCapacity)
+    {
+        size_t capacity = queue->nameCapacity == 0 ? 1024 : 2 * queue->nameCapacity;
+        uint64_t *names = calloc(capacity, sizeof(uint64_t));
+        if (names == NULL)
+            return ENOMEM;
+        for (size_t i = 0; i < queue->nameCapacity; i ++)
+        {
+            if (queue->names[i] == 0)
+                continue;
+            size_t slot = queue->names[i] & (capacity - 1);
+            while (names[slot] != 0)
+                slot = (slot + 1) & (capacity - 1);
+            names[slot] = queue->names[i];
+        }
+        free(queue->names);
+        queue->names = names;
+        queue->nameCapacity = capacity;
+    }
+    size_t slot = hash & (queue->nameCapacity - 1);
+    while (queue->names[slot] != 0 && queue->names[slot] != hash)
+        slot = (slot + 1) & (queue->nameCapacity - 1);
+    if (queue->names[slot] == 0)
+    {
+        queue->names[slot] = hash;
+        queue->nameCount ++;
+        return E_OK;
+    }
+    pthread_mutex_lock(&queue->lock);
+    while (queue->queuedBytes > 0)      // Counts jobs until they are written, not only until taken
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    pthread_mutex_unlock(&queue->lock);
+    return E_OK;
+}
+
+//  function: UnpackWorker
+//      Thread body for UnpackArchive. Creates queued files until the reader
+//      is done and the queue is empty.
+//  @param: pointer to the shared UnpackQueue
+//  @return: NULL
+void *
+UnpackWorker(void *arg)
+{
+    struct UnpackQueue *queue = arg;
+    pthread_mutex_lock(&queue->lock);
+    for (;;)
+    {
+        while (queue->head == NULL && !queue->done)
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        if (queue->head == NULL)
+            break;
+        struct UnpackJob *job = queue->head;
+        queue->head = job->next;
+        if (queue->head == NULL)
+            queue->tail = NULL;
+        pthread_mutex_unlock(&queue->lock);
+
+        int status = E_OK;
+        int fd = UnpackCreate(queue->rootFd, job->name, job->mode);
+        if (fd == E_GENERAL)
+            status = errno;
+        else
+        {
+            for (size_t done = 0; done < job->size && status == E_OK; )
+            {
+                ssize_t written = write(fd, job->data + done, job->size - done);
+                if (written == E_GENERAL)
+                    status = errno;
+                else
+                    done += written;
+            }
+            if (status == E_OK)
+                status = UnpackFinish(fd, job->mode, job->mtime, job->name);
+            if (status == E_OK)
+                StatsAdd(STAT_BYTES_WRITTEN, job->size);
+            close(fd);
+        }
+        if (status != E_OK && fLog)
+            LogMessage("\nCould not unpack file ", job->name, ": ", GetErrorMessage(status), NULL);
+
+        pthread_mutex_lock(&queue->lock);
+        if (status != E_OK)
+            SetFirstError(&queue->status, status);
+        queue->queuedBytes -= job->size + strlen(job->name);
+        free(job);
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+//  function: UnpackLargeFile
+//      Extracts a file too large to queue on the reader thread. After the 
+//      buffered part, the data is moved with splice (pipe input) or 
+//      copy_file_range (file input) without passing through user space.
+//  @param: pointer to the UnpackQueue
+//  @param: pointer to the input stream
+//  @param: pointer to the relative name
+//  @param: mode of the file
+//  @param: mtime of the file
+//  @param: size of the file
+//  @return: Integer error code
+int
+UnpackLargeFile(struct UnpackQueue *queue, struct UnpackStream *stream, char *name, mode_t mode, int64_t mtime, off_t size)
+{
+    int fd = UnpackCreate(queue->rootFd, name, mode);
+    int status = E_OK;
+    if (fd == E_GENERAL)
+    {
+        status = errno;
+        UnpackSkip(stream, size);
+        return status;
+    }
+    off_t remaining = size;
+    size_t buffered = stream->end - stream->start < (size_t) remaining ? stream->end - stream->start : (size_t) remaining;
+    for (size_t done = 0; done < buffered && status == E_OK; )
+    {
+        ssize_t written = write(fd, stream->buffer + stream->start + done, buffered - done);
+        if (written == E_GENERAL)
+            status = errno;
+        else
+            done += written;
+    }
+    stream->start += buffered;
+    remaining -= buffered;
+    int method = UNPACK_SPLICE;
+    while (remaining > 0 && status == E_OK)
+    {
+        ssize_t moved = E_GENERAL;
+        if (method == UNPACK_SPLICE)
+            moved = splice(stream->fd, NULL, fd, NULL, remaining, SPLICE_F_MOVE);
+        else if (method == UNPACK_COPY_RANGE)
+            moved = copy_file_range(stream->fd, NULL, fd, NULL, remaining, 0);
+        else
+        {
+            moved = read(stream->fd, stream->buffer, remaining < PACK_BUF_SIZE ? remaining : PACK_BUF_SIZE);
+            for (ssize_t done = 0; moved > 0 && done < moved; )
+            {
+                ssize_t written = write(fd, stream->buffer + done, moved - done);
+                if (written == E_GENERAL)
+                {
+                    status = errno;
+                    break;
+                }
+                done += written;
+            }
+        }
+        if (moved == E_GENERAL)
+        {
+            if (method != UNPACK_READ && (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP))
+            {
+                method ++;       // Not supported for this input, try the next way
+                continue;
+            }
+            status = errno;
+        }
+        else if (moved == 0)
+            status = EIO;       // Archive ends in the middle of a file
+        else
+            remaining -= moved;
+    }
+    if (status == E_OK)
+        status = UnpackFinish(fd, mode, mtime, name);
+    if (status == E_OK)
+        StatsAdd(STAT_BYTES_WRITTEN, size);
+    close(fd);
+    return status;
+}
+
+//  function: UnpackCreate
+//      Creates a file relative to the target directory. If its directory is
+//      missing (archives without directory entries) it is created first.
+//  @param: Integer fd of the target directory
+//  @param: pointer to the relative name
+//  @param: mode of the file
+//  @return: file descriptor, E_GENERAL on error with errno set
+int
+UnpackCreate(int rootFd, char *name, mode_t mode)
+{
+    char *base;
+    int parentFd = OpenParentBeneath(rootFd, name, ENABLE, O_PATH, &base);
+    if (parentFd == E_GENERAL)
+        return E_GENERAL;
+    int fd = openat(parentFd, base, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, mode | S_IWUSR);
+    int error = errno;
+    if (parentFd != rootFd)
+        close(parentFd);
+    errno = error;
+    return fd;
+}
+
+//  function: OpenParentBeneath
+//      Opens the directory holding an entry given relative to a root fd with
+//      openat2, so no symbolic link is followed on the way and nothing 
+//      outside the root is reached. Missing directories are created one level
+//      at a time, each opened with O_NOFOLLOW before the next is made in it.
+//      Names too long for a single call are walked the same way, so there is
+//      no limit on their length.
+//  @param: Integer fd of the root directory
+//  @param: pointer to the relative name
+//  @param: Integer ENABLE to create missing directories
+//  @param: Integer open flags, O_PATH or O_RDONLY if the fd is synced
+//  @param: pointer to where the last component of the name is stored
+//  @return: directory fd, rootFd itself for names without a directory, 
+//           E_GENERAL on error with errno set
+int
+OpenParentBeneath(int rootFd, char *name, int create, int flags, char **base)
+{
+    char *slash = strrchr(name, '/');
+    *base = slash == NULL ? name : slash + 1;
+    if (slash == NULL)
+        return rootFd;
+    struct PathBuilder parent;
+    if (PathInit(&parent, "") != E_OK)
+    {
+        errno = ENOMEM;
+        return E_GENERAL;
+    }
+    if (PathAppend(&parent, name, slash - name) != E_OK)
+    {
+        PathFree(&parent);
+        errno = ENOMEM;
+        return E_GENERAL;
+    }
+    struct open_how how = {flags | O_DIRECTORY | O_CLOEXEC, 0, RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS};
+    int fd = syscall(SYS_openat2, rootFd, parent.path, &how, sizeof(how));
+    if (fd == E_GENERAL && ((errno == ENOENT && create) || errno == ENOSYS || errno == ENAMETOOLONG))
+    {
+        // Walk down one component at a time, also the way without openat2
+        fd = rootFd;
+        for (char *component = parent.path; *component != '\0' && fd != E_GENERAL; )
+        {
+            size_t length = strcspn(component, "/");
+            char separator = component[length];
+            component[length] = '\0';
+            int next = E_GENERAL;
+            if (length > 0 && create && mkdirat(fd, component, createMode | S_IRWXU) == E_GENERAL && errno != EEXIST)
+                next = E_GENERAL;
+            else if (length > 0)
+                next = openat(fd, component, (separator == '\0' ? flags : O_PATH) | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            else
+                next = fd;      // Empty component from a doubled slash
+            int error = errno;
+            if (next != fd && fd != rootFd)
+                close(fd);
+            fd = next;
+            errno = error;
+            component[length] = separator;
+            component += separator == '\0' ? length : length + 1;
+        }
+    }
+    int error = errno;
+    PathFree(&parent);
+    errno = error;
+    return fd;
+}
+
+//  function: UnpackDefer
+//      Remembers a link or directory for UnpackRestore. New entries go to 
+//      the front, so the list holds children before their parents.
+//  @param: pointer to the list head
+//  @param: TAR_SYMLINK, TAR_HARDLINK or TAR_DIRECTORY
+//  @param: pointer to the relative name
+//  @param: pointer to the link target, NULL for a directory
+//  @param: mode from the archive
+//  @param: mtime from the archive
+//  @return: Integer error code
+int
+UnpackDefer(struct UnpackDeferred **list, char type, char *name, char *target, mode_t mode, int64_t mtime)
+{
+    size_t nameLength = strlen(name);
+    size_t targetLength = target == NULL ? 0 : strlen(target);
+    struct UnpackDeferred *entry = malloc(sizeof(struct UnpackDeferred) + nameLength + targetLength + 2);
+    if (entry == NULL)
+        return ENOMEM;
+    entry->type = type;
+    entry->mode = mode;
+    entry->mtime = mtime;
+    memcpy(entry->name, name, nameLength + 1);
+    entry->target = entry->name + nameLength + 1;
+    memcpy(entry->target, target == NULL ? "" : target, targetLength + 1);
+    entry->next = *list;
+    *list = entry;
+    return E_OK;
+}
+
+//  function: UnpackRestore
+//      Finishes an extraction once all files are written. Symbolic links are
+//      created first, then hard links (an existing entry of that name is 
+//      replaced, like tar does), then directories get their mode and mtime,
+//      deepest first, so a directory that is not writable is only closed at 
+//      the end. Both names of a hard link are resolved beneath the target.
+//  @param: Integer fd of the target directory
+//  @param: pointer to the list from UnpackDefer
+//  @return: Integer error code of the first failure
+int
+UnpackRestore(int rootFd, struct UnpackDeferred *list)
+{
+    int status = E_OK;
+    static char passes[] = {TAR_SYMLINK, TAR_HARDLINK, TAR_DIRECTORY};
+    for (int pass = 0; pass < 3; pass ++)
+    {
+        for (struct UnpackDeferred *entry = list; entry != NULL; entry = entry->next)
+        {
+            if (entry->type != passes[pass])
+                continue;
+            char *base;
+            int error = E_OK;
+            int parentFd = OpenParentBeneath(rootFd, entry->name, entry->type != TAR_DIRECTORY, O_PATH, &base);
+            if (parentFd == E_GENERAL)
+                error = errno;
+            else if (entry->type == TAR_SYMLINK)
+            {
+                if (symlinkat(entry->target, parentFd, base) == E_GENERAL && errno != EEXIST)
+                    error = errno;
+            }
+            else if (entry->type == TAR_HARDLINK)
+            {
+                char *targetBase;
+                int targetFd = OpenParentBeneath(rootFd, entry->target, DISABLE, O_PATH, &targetBase);
+                if (targetFd == E_GENERAL)
+                    error = errno;
+                else if (linkat(targetFd, targetBase, parentFd, base, 0) == E_GENERAL)
+                {
+                    error = errno;
+                    if (error == EEXIST && unlinkat(parentFd, base, 0) == E_OK)
+                        error = linkat(targetFd, targetBase, parentFd, base, 0) == E_GENERAL ? errno : E_OK;
+                }
+                if (error == E_OK)
+                    StatsAdd(STAT_CREATED, 1);
+                if (targetFd != E_GENERAL && targetFd != rootFd)
+                    close(targetFd);
+            }
+            else
+            {
+                struct timespec times[2] = {{0, UTIME_OMIT}, {entry->mtime, 0}};
+                int fd = openat(parentFd, base, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (fd == E_GENERAL || fchmod(fd, entry->mode) == E_GENERAL || futimens(fd, times) == E_GENERAL)
+                    error = errno;
+                if (fd != E_GENERAL)
+                    close(fd);
+            }
+            if (parentFd != E_GENERAL && parentFd != rootFd)
+                close(parentFd);
+            if (error != E_OK)
+            {
+                SetFirstError(&status, error);
+                if (fLog)
+                    LogMessage("\nCould not unpack ", entry->name, ": ", GetErrorMessage(error), NULL);
+            }
+        }
+    }
+    return status;
+}
+
+//  function: UnpackFinish
+//      Gives an extracted file its final mode and mtime
+//  @param: Integer fd of the file
+//  @param: mode from the archive
+//  @param: mtime from the archive
+//  @param: pointer to the name, used for logging
+//  @return: Integer error code
+int
+UnpackFinish(int fd, mode_t mode, int64_t mtime, char *name)
+{
+    struct timespec times[2] = {{0, UTIME_OMIT}, {mtime, 0}};
+    if (fchmod(fd, mode) == E_GENERAL || futimens(fd, times) == E_GENERAL)
+        return errno;
+    StatsAdd(STAT_CREATED, 1);
+    return DurableFile(fd, name);
+}
+
+//  function: UnpackRead
+//      Reads exactly length bytes from the input stream
+//  @param: pointer to the input stream
+//  @param: pointer to destination
+//  @param: number of bytes
+//  @return: Integer error code, EIO if the archive ends early
+int
+UnpackRead(struct UnpackStream *stream, void *destination, size_t length)
+{
+    char *bytes = destination;
+    while (length > 0)
+    {
+        if (stream->start == stream->end)
+        {
+            ssize_t nread = read(stream->fd, stream->buffer, PACK_BUF_SIZE);
+            if (nread == E_GENERAL)
+            {
+                if (errno == EINTR)
+                    continue;
+                return errno;
+            }
+            if (nread == 0)
+                return EIO;
+            stream->start = 0;
+            stream->end = nread;
+        }
+        size_t chunk = stream->end - stream->start < length ? stream->end - stream->start : length;
+        if (bytes != NULL)
+        {
+            memcpy(bytes, stream->buffer + stream->start, chunk);
+            bytes += chunk;
+        }
+        stream->start += chunk;
+        length -= chunk;
+    }
+    return E_OK;
+}
+
+//  function: UnpackSkip
+//      Skips bytes of the input stream
+//  @param: pointer to the input stream
+//  @param: number of bytes
+//  @return: Integer error code
+int
+UnpackSkip(struct UnpackStream *stream, off_t length)
+{
+    return UnpackRead(stream, NULL, length);
+}
+
+//  function: DurableFile
+//      Makes the data of a file that was just written durable according to
+//      --durability. strict syncs it right away, batch only notes that its
+//      filesystem has to be synced at the next commit point.
+//  @param: Integer fd of the file
+//  @param: pointer to file path, used for logging
+//  @return: Integer error code
+int
+DurableFile(int fd, char *path)
+{
+    struct stat fileInfo;
+    int status = E_OK;
+    if (durability == DURABILITY_NONE)
+        return E_OK;
+    if (durability == DURABILITY_STRICT)
+        status = fdatasync(fd);
+    else
+    {
+        status = fstat(fd, &fileInfo);
+        if (status == E_OK)
+            return DurableRegister(fileInfo.st_dev, fd, NULL);
+    }
+    if (status == E_OK)
+        return E_OK;
+    status = errno;
+    if (fLog && path != logFileName)    // A failing log file must not log about itself
+        LogMessage("\nCould not sync ", path, ": ", GetErrorMessage(status), NULL);
+    return status;
+}
+
+//  function: DurableDirectory
+//      Same as DurableFile for an open directory whose entries were changed
+//  @param: Integer fd of the directory
+//  @param: pointer to directory path, used for logging
+//  @return: Integer error code
+int
+DurableDirectory(int dirFd, char *path)
+{
+    if (durability == DURABILITY_STRICT && fsync(dirFd) == E_GENERAL)
+    {
+        int status = errno;
+        if (fLog)
+            LogMessage("\nCould not sync directory ", path, ": ", GetErrorMessage(status), NULL);
+        return status;
+    }
+    return DurableFile(dirFd, path);
+}
+
+//  function: DurableParent
+//      Makes the directory entry of a created, renamed or removed path 
+//      durable by syncing its parent directory according to --durability
+//  @param: pointer to path whose entry changed
+//  @param: pointer to a second changed path (old name of a rename), may be NULL
+//  @return: Integer error code
+int
+DurableParent(char *path, char *otherPath)
+{
+    struct PathBuilder parent;
+    struct stat fileInfo;
+    int status = E_OK;
+    if (durability == DURABILITY_NONE)
+        return E_OK;
+    size_t length = ParentLength(path);
+    if (PathInit(&parent, length == 0 ? "." : path) != E_OK)
+        return ENOMEM;
+    if (length > 0)
+        PathPop(&parent, length);
+    if (durability == DURABILITY_STRICT)
+    {
+        int fd = open(parent.path, O_RDONLY | O_DIRECTORY);
+        if (fd == E_GENERAL || fsync(fd) == E_GENERAL)
+            status = errno;
+        if (fd != E_GENERAL)
+            close(fd);
+    }
+    else if (stat(parent.path, &fileInfo) == E_GENERAL)
+        status = errno;
+    else
+        status = DurableRegister(fileInfo.st_dev, E_GENERAL, parent.path);
+    if (status != E_OK && fLog)
+        LogMessage("\nCould not sync directory ", parent.path, ": ", GetErrorMessage(status), NULL);
+    PathFree(&parent);
+    if (status != E_OK || otherPath == NULL)
+        return status;
+    size_t otherLength = ParentLength(otherPath);
+    if (otherLength == length && strncmp(path, otherPath, length) == 0)
+        return E_OK;    // Same directory, already synced
+    return DurableParent(otherPath, NULL);
+}
+
+//  function: ParentLength
+//      Finds where the parent directory part of a path ends
+//  @param: pointer to path
+//  @return: length of the parent part, 0 if the path has no directory part
+size_t
+ParentLength(char *path)
+{
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/')
+        length --;      // Ignore trailing slashes
+    while (length > 0 && path[length - 1] != '/')
+        length --;
+    while (length > 1 && path[length - 1] == '/')
+        length --;      // Drop the separator but keep "/" for the root
+    return length;
+}
+
+//  function: DurableRegister
+//      Notes a filesystem with uncommitted changes for batch durability and
+//      commits the batch when enough changes or time have piled up
+//  @param: device of the filesystem
+//  @param: Integer fd on that filesystem, or E_GENERAL to open path instead
+//  @param: pointer to a directory on that filesystem, used when fd is E_GENERAL
+//  @return: Integer error code
+int
+DurableRegister(dev_t device, int fd, char *path)
+{
+    int status = E_OK;
+    pthread_mutex_lock(&durableBatch.lock);
+    int found = 0;
+    for (; found < durableBatch.count && durableBatch.devices[found] != device; found ++);
+    if (found == durableBatch.count)
+    {
+        int keptFd = fd != E_GENERAL ? dup(fd) : open(path, O_RDONLY | O_DIRECTORY);
+        if (keptFd == E_GENERAL)
+            status = errno;
+        else if (durableBatch.count == MAX_BATCH_FILESYSTEMS)
+        {
+            if (syncfs(keptFd) == E_GENERAL)    // No room to remember it, commit this one right away
+                status = errno;
+            close(keptFd);
+        }
+        else
+        {
+            durableBatch.devices[durableBatch.count] = device;
+            durableBatch.fds[durableBatch.count ++] = keptFd;
+        }
+    }
+    time_t now = time(NULL);
+    if (durableBatch.lastCommit == 0)
+        durableBatch.lastCommit = now;
+    int commitDue = ++ durableBatch.operations >= BATCH_COMMIT_OPERATIONS || now - durableBatch.lastCommit >= BATCH_COMMIT_SECONDS;
+    pthread_mutex_unlock(&durableBatch.lock);
+    if (commitDue && status == E_OK)
+        status = DurableCommit();
+    return status;
+}
+
+//  function: DurableCommit
+//      Commit point for batch durability, syncs every filesystem that has 
+//      changes with a single syncfs instead of one fsync per file
+//  @param: None
+//  @return: Integer error code
+int
+DurableCommit()
+{
+    int fds[MAX_BATCH_FILESYSTEMS];
+    int status = E_OK;
+    pthread_mutex_lock(&durableBatch.lock);
+    int count = durableBatch.count;
+    memcpy(fds, durableBatch.fds, count * sizeof(int));
+    durableBatch.operations = 0;
+    durableBatch.lastCommit = time(NULL);
+    pthread_mutex_unlock(&durableBatch.lock);
+    for (int i = 0; i < count; i ++)
+    {
+        if (syncfs(fds[i]) == E_GENERAL && status == E_OK)
+            status = errno;
+    }
+    if (status != E_OK && fLog)
+        LogMessage("\nCould not commit batch: ", GetErrorMessage(status), NULL);
+    return status;
+}
+
+//  function: DurableTimer
+//      Thread body that commits the batch once changes have waited for 
+//      BATCH_COMMIT_SECONDS, so the time limit holds even when no further
+//      change comes in to trigger the commit. Runs until stop is set.
+//  @param: None
+//  @return: NULL
+void *
+DurableTimer(void *arg)
+{
+    pthread_mutex_lock(&durableBatch.lock);
+    while (!durableBatch.stop)
+    {
+        time_t now = time(NULL);
+        if (durableBatch.operations > 0 && now - durableBatch.lastCommit >= BATCH_COMMIT_SECONDS)
+        {
+            pthread_mutex_unlock(&durableBatch.lock);
+            int status = DurableCommit();
+            pthread_mutex_lock(&durableBatch.lock);
+            if (status != E_OK && durableBatch.status == E_OK)
+                durableBatch.status = status;
+            continue;
+        }
+        struct timespec deadline = {(durableBatch.operations > 0 ? durableBatch.lastCommit : now) + BATCH_COMMIT_SECONDS, 0};
+        pthread_cond_timedwait(&durableBatch.wake, &durableBatch.lock, &deadline);
+    }
+    pthread_mutex_unlock(&durableBatch.lock);
+    return NULL;
+}
+
+//  function: CreateLog
+//      Logs specified message to a log file
+//  @param: pointer to message
+//  @param: length of the message in bytes
+//  @return: Integer error code
+int
+CreateLog(char *message, size_t length)
+{
+    int status = NonBlockingOperation(&write, O_APPEND | O_WRONLY | O_CREAT, logFileName, message, length, S_IRWXU, DISABLE);
+        return status;
+}
+
+//  function: LogMessage
+//      Joins a NULL terminated list of strings into one message and logs it.
+//  @param: pointers to the parts of the message, last one must be NULL
+//  @return: Integer error code
+int
+LogMessage(const char *first, ...)
+{
+    size_t length;
+    va_list args;
+    struct ArenaMark mark = ArenaSave(&threadArena);
+    va_start(args, first);
+    char *message = JoinParts(&length, first, args);
+    va_end(args);
+    int status = message ? CreateLog(message, length) : ENOMEM;
+    ArenaRestore(&threadArena, mark);
+    return status;
+}
+
+//  function: PrintMessage
+//      Joins a NULL terminated list of strings and writes them to stdout (to
+//      stderr while an archive goes to stdout) with a single write, so lines
+//      from different threads do not interleave.
+//  @param: pointers to the parts of the message, last one must be NULL
+//  @return: Integer error code
+int
+PrintMessage(const char *first, ...)
+{
+    size_t length;
+    va_list args;
+    struct ArenaMark mark = ArenaSave(&threadArena);
+    va_start(args, first);
+    char *message = JoinParts(&length, first, args);
+    va_end(args);
+    int status = message ? NonBlockingOperation(&write, O_WRONLY, messageStream, message, length, -1, DISABLE) : ENOMEM;
+    ArenaRestore(&threadArena, mark);
+    return status;
+}
+
+//  function: JoinParts
+//      Concatenates strings into the thread arena. The parts are measured in
+//      a first pass and copied with memcpy in a second, so there is no limit 
+//      on their number or size. The caller releases the memory with 
+//      ArenaRestore.
+//  @param: pointer to where the total length is stored
+//  @param: pointer to first part
+//  @param: remaining parts, terminated by NULL
+//  @return: pointer to joined string, NULL if out of memory
+char *
+JoinParts(size_t *length, const char *first, va_list args)
+{
+    size_t total = 0;
+    va_list measure;
+    va_copy(measure, args);     // First pass sizes the message, so any number of parts fits
+    for (const char *part = first; part != NULL; part = va_arg(measure, const char *))
+        total += strlen(part);
+    va_end(measure);
+    char *message = ArenaAlloc(&threadArena, total + 1);
+    if (message == NULL)
+        return NULL;
+    char *cursor = message;
+    for (const char *part = first; part != NULL; part = va_arg(args, const char *))
+    {
+        size_t partLength = strlen(part);
+        memcpy(cursor, part, partLength);
+        cursor += partLength;
+    }
+    *cursor = '\0';
+    *length = total;
+    return message;
+}
+
+//  function: ArenaAlloc
+//      Bump allocates size bytes from an arena, starting a new block when the
+//      current one is full. Large requests get a block of their own.
+//  @param: pointer to arena
+//  @param: number of bytes needed
+//  @return: pointer to the memory, NULL if out of memory
+void *
+ArenaAlloc(struct Arena *arena, size_t size)
+{
+    size = (size + 15) & ~(size_t) 15;     // Keep every allocation 16 byte aligned
+    struct ArenaBlock *block = arena->current;
+    if (block == NULL || block->size - block->used < size)
+    {
+        size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(struct ArenaBlock) + blockSize);
+        if (block == NULL)
+            return NULL;
+        block->previous = arena->current;
+        block->used = 0;
+        block->size = blockSize;
+        arena->current = block;
+    }
+    void *memory = block->data + block->used;
+    block->used += size;
+    return memory;
+}
+
+//  function: ArenaSave
+//      Remembers the fill level of an arena
+//  @param: pointer to arena
+//  @return: mark to pass to ArenaRestore
+struct ArenaMark
+ArenaSave(struct Arena *arena)
+{
+    struct ArenaMark mark = {arena->current, arena->current ? arena->current->used : 0};
+    return mark;
+}
+
+//  function: ArenaRestore
+//      Frees everything allocated from an arena since the mark was taken
+//  @param: pointer to arena
+//  @param: mark returned by ArenaSave
+//  @return: None
+void
+ArenaRestore(struct Arena *arena, struct ArenaMark mark)
+{
+    while (arena->current != mark.block)
+    {
+        struct ArenaBlock *previous = arena->current->previous;
+        free(arena->current);
+        arena->current = previous;
+    }
+    if (arena->current != NULL)
+        arena->current->used = mark.used;
+}
+
+//  function: PathInit
+//      Starts a path builder with the given root path
+//  @param: pointer to path builder
+//  @param: pointer to root path
+//  @return: Integer error code
+int
+PathInit(struct PathBuilder *pathBuilder, const char *root)
+{
+    size_t length = strlen(root);
+    pathBuilder->capacity = length + 1 > PATH_INITIAL_SIZE ? 2 * length + 1 : PATH_INITIAL_SIZE;
+    pathBuilder->path = malloc(pathBuilder->capacity);
+    if (pathBuilder->path == NULL)
+        return ENOMEM;
+    memcpy(pathBuilder->path, root, length + 1);
+    pathBuilder->length = length;
+    return E_OK;
+}
+
+//  function: PathAppend
+//      Appends raw bytes to the path without adding a separator. The path 
+//      is left as it was if it cannot grow.
+//  @param: pointer to path builder
+//  @param: pointer to bytes to append
+//  @param: number of bytes to append
+//  @return: Integer error code, ENOMEM if the path cannot grow
+int
+PathAppend(struct PathBuilder *pathBuilder, const char *text, size_t length)
+{
+    size_t previousLength = pathBuilder->length;
+    if (previousLength + length + 1 > pathBuilder->capacity)
+    {
+        size_t capacity = 2 * pathBuilder->capacity;
+        while (capacity < previousLength + length + 1)
+            capacity *= 2;
+        char *path = realloc(pathBuilder->path, capacity);
+        if (path == NULL)
+            return ENOMEM;
+        pathBuilder->path = path;
+        pathBuilder->capacity = capacity;
+    }
+    memcpy(pathBuilder->path + previousLength, text, length);
+    pathBuilder->length = previousLength + length;
+    pathBuilder->path[pathBuilder->length] = '\0';
+    return E_OK;
+}
+
+//  function: PathPush
+//      Adds one component to the path, inserting a '/' when needed. The 
+//      path is left as it was if it cannot grow.
+//  @param: pointer to path builder
+//  @param: pointer to component name
+//  @param: length of the component name
+//  @return: Integer error code, ENOMEM if the path cannot grow
+int
+PathPush(struct PathBuilder *pathBuilder, const char *name, size_t length)
+{
+    size_t previousLength = pathBuilder->length;
+    int status = E_OK;
+    if (previousLength > 0 && pathBuilder->path[previousLength - 1] != '/')
+        status = PathAppend(pathBuilder, "/", 1);
+    if (status == E_OK)
+        status = PathAppend(pathBuilder, name, length);
+    if (status != E_OK)
+        PathPop(pathBuilder, previousLength);
+    return status;
+}
+
+//  function: PathPop
+//      Cuts the path back to an earlier length
+//  @param: pointer to path builder
+//  @param: length the path had before PathPush or PathAppend
+//  @return: None
+void
+PathPop(struct PathBuilder *pathBuilder, size_t previousLength)
+{
+    pathBuilder->length = previousLength;
+    pathBuilder->path[previousLength] = '\0';
+}
+
+//  function: PathFree
+//      Releases the memory of a path builder
+//  @param: pointer to path builder
+//  @return: None
+void
+PathFree(struct PathBuilder *pathBuilder)
+{
+    free(pathBuilder->path);
+    pathBuilder->path = NULL;
+    pathBuilder->length = pathBuilder->capacity = 0;
+}
+
+//  function: ChmodAt
+//      Changes the mode of an entry relative to a directory fd without ever
+//      following a symbolic link in its place. fchmodat supports that only 
+//      through /proc, without it the entry is opened with O_NOFOLLOW and 
+//      changed with fchmod.
+//  @param: Integer fd of the directory holding the entry
+//  @param: pointer to the entry name
+//  @param: mode to set
+//  @return: Integer error code, EOPNOTSUPP if the entry is a symbolic link
+int
+ChmodAt(int dirFd, char *name, mode_t mode)
+{
+    if (fchmodat(dirFd, name, mode, AT_SYMLINK_NOFOLLOW) == E_OK)
+        return E_OK;
+    if (errno != EOPNOTSUPP && errno != ENOSYS)
+        return errno;
+    int fd = openat(dirFd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd == E_GENERAL)
+        return errno == ELOOP ? EOPNOTSUPP : errno;
+    int status = fchmod(fd, mode) == E_GENERAL ? errno : E_OK;
+    close(fd);
+    return status;
+}
+
+//  function: FormatLong
+//      Writes the decimal form of a non negative number, null terminated
+//  @param: pointer to buffer of at least 21 bytes
+//  @param: number to format
+//  @return: number of digits written
+int
+FormatLong(char *buffer, long number)
+{
+    char digits[20];
+    int count = 0;
+    do
+    {
+        digits[count ++] = '0' + number % 10;
+        number /= 10;
+    } while (number > 0);
+    for (int i = 0; i < count; i ++)
+        buffer[i] = digits[count - 1 - i];
+    buffer[count] = '\0';
+    return count;
+}
+
+//  function: RaiseFileLimit
+//      Raises the soft limit on open files to the hard limit. Walks hold one
+//      fd per level of the tree, so deep trees need more than the usual 1024.
+//  @param: None
+//  @return: Integer error code
+int
+RaiseFileLimit()
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == E_GENERAL)
+        return errno;
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) == E_GENERAL)
+        return errno;
+    return E_OK;
 }
 
 //  function: GetErrorMessage